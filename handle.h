@@ -1,6 +1,16 @@
 #pragma once
 
 #include <type_traits> // std::is_integral/std::is_unsigned/std::forward
+#include <atomic>      // std::atomic
+#include <stdint.h>    // uint64_t
+#include <string.h>    // memset/memcpy
+#include <cstddef>     // std::max_align_t
+#include <new>         // std::nothrow
+#include <thread>      // std::this_thread::yield
+
+#if defined(_MSC_VER)
+#include <intrin.h>    // _BitScanForward64
+#endif
 
 #ifdef HDL_USER_CONFIG
 #include HDL_USER_CONFIG
@@ -21,20 +31,229 @@
 #define HDL_MUTEX std::mutex
 #endif
 
-template <typename, typename, size_t> class HandlePool;
+// Used on the few reads that are racy by design (and harmless), to keep ThreadSanitizer reports meaningful.
+// Only defined in ThreadSanitizer builds, the noinline would cost a call in the others.
+#if defined(__SANITIZE_THREAD__) // GCC
+#define HDL_TSAN_ENABLED
+#elif defined(__has_feature)      // Clang
+#if __has_feature(thread_sanitizer)
+#define HDL_TSAN_ENABLED
+#endif
+#endif
+
+#if defined(HDL_TSAN_ENABLED) && (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 8))
+#define HDL_NO_SANITIZE_THREAD __attribute__((no_sanitize("thread"), noinline))
+#else
+#define HDL_NO_SANITIZE_THREAD
+#endif
+
+namespace HDL
+{
+	/// Index of the lowest set bit of _bits (which must not be 0).
+	inline unsigned CountTrailingZeros(uint64_t _bits)
+	{
+	#if defined(_MSC_VER) && defined(_WIN64)
+		unsigned long index;
+		_BitScanForward64(&index, _bits);
+		return (unsigned)index;
+	#elif defined(__GNUC__) || defined(__clang__)
+		return (unsigned)__builtin_ctzll(_bits);
+	#else
+		unsigned index = 0;
+		while ((_bits & 1) == 0) { _bits >>= 1; ++index; }
+		return index;
+	#endif
+	}
+
+	// Growth policies, used by HandlePool to decide by how much the node buffer grows when it's full.
+	// Growing commits memory while the pool mutex is held, so bigger steps mean fewer (slow) commits under the lock,
+	// at the cost of committing memory that may never be used.
+	// GetGrowSizeBytes returns the number of bytes to add to the buffer. It is rounded up to whole pages (or chunks, see DefaultPolicy::kChunkedStorage),
+	// and the pool always grows by at least one node (and never above MaxHandles).
+
+	/// Grows by NumPages pages at a time.
+	template <size_t NumPages>
+	struct GrowByPages
+	{
+		static size_t GetGrowSizeBytes(size_t /*_capacityBytes*/, size_t _pageSize) { return NumPages * _pageSize; }
+	};
+
+	/// Grows by a fixed amount of bytes at a time (eg. 2 MiB chunks for types that are created in bursts).
+	template <size_t NumBytes>
+	struct GrowByBytes
+	{
+		static size_t GetGrowSizeBytes(size_t /*_capacityBytes*/, size_t /*_pageSize*/) { return NumBytes; }
+	};
+
+	/// Grows geometrically: the new capacity is Numerator/Denominator times the current one (eg. 3/2 for +50%).
+	/// The first growth commits MinPages pages.
+	template <size_t Numerator = 2, size_t Denominator = 1, size_t MinPages = 1>
+	struct GrowGeometric
+	{
+		static_assert(Numerator > Denominator, "The growth factor must be greater than 1.");
+
+		static size_t GetGrowSizeBytes(size_t _capacityBytes, size_t _pageSize)
+		{
+			size_t growSize = _capacityBytes / Denominator * (Numerator - Denominator);
+			return growSize > MinPages * _pageSize ? growSize : MinPages * _pageSize;
+		}
+	};
+
+	/// Type-erased task passed to the executors of ParallelForEach: calling it with i runs the i-th chunk.
+	/// An executor is any callable taking (size_t _numTasks, const ParallelTask& _task) that calls _task(i) once for every i 
+	/// in [0, _numTasks), in any order and on any thread, and only returns once they all have returned (see HDL::ThreadPool
+	/// in handle_thread_pool.h, or plug in your job system).
+	struct ParallelTask
+	{
+		void (*m_function)(const void* _context, size_t _taskIndex);
+		const void* m_context;
+
+		void operator()(size_t _taskIndex) const { m_function(m_context, _taskIndex); }
+	};
+
+	/// Minimum size of the chunks of ParallelForEach. The chunk boundaries are rounded up to whole pages (of the node buffer), 
+	/// and each node goes to the chunk where it starts. When sizeof(Node) doesn't divide the page size, the last node of a chunk 
+	/// ends in the first page of the next one: two workers then share that page, and the cache line after the boundary.
+	static const size_t kParallelChunkMinBytes = 64 * 1024;
+
+	/// How HandlePool stores the free indices (the indices of the destroyed elements), and in which order the next creations reuse them.
+	/// The order decides how long the stale handles of a node stay invalid: a node's version is incremented every time the node is destroyed,
+	/// and a stale handle becomes valid again when the version wraps around, after 2^kVersionNumBits reuses of the same node.
+	enum class FreeListMode
+	{
+		LockedFifo,    ///< FIFO: free indices are reused in the order they were freed, and only once all the nodes of the buffer are used. 
+		               ///< A node is reused at most once every (number of free nodes) creations, which delays the wrapping of the versions 
+		               ///< as much as possible, but the reused node is the coldest one. Create/Destroy always lock the pool mutex.
+		LockFreeStack, ///< LIFO, lock-free: free indices are stored in a lock-free stack threaded through the free nodes. Create/Destroy only 
+		               ///< lock the pool mutex when the node buffer needs to grow. The most recently freed (and cache-hot) node is reused first,
+		               ///< but the unused nodes at the end of the buffer are still used before the free ones.
+		               ///< Versions: with a create/destroy churn, the same node can be reused every other creation, so its version wraps 
+		               ///< around after 2^kVersionNumBits churn cycles (eg. 256 with 8 bits of version).
+		LockedFullestPage, ///< Page-local: free indices are reused from the fullest page (of the node buffer) that has free nodes first, and before the
+		                   ///< unused nodes at the end of the buffer. After churn, the elements stay packed in few pages (which helps ForEach and
+		                   ///< the cache), and the mostly empty pages drain. Note: ShrinkToFit only releases the end of the buffer, the drained 
+		                   ///< pages before the last element stay committed. Create/Destroy always lock the pool mutex. 
+		                   ///< Versions: inside a page the order is LIFO, same wrapping as LockedLifo.
+		LockedLifo,    ///< LIFO: the most recently freed (and cache-hot) node is reused first, even before the unused nodes at the end of 
+		               ///< the buffer. For high churn of short-lived elements. Create/Destroy always lock the pool mutex.
+		               ///< Versions: same wrapping as LockFreeStack, use enough version bits for the churn rate (or kRetireSaturatedNodes).
+	};
+
+	/// Default per-type settings of Handle/HandlePool.
+	/// To customize them, inherit from DefaultPolicy, override what needs to be overridden and pass it as the Policy template parameter of Handle.
+	/// @code
+	/// struct EntityPolicy : HDL::DefaultPolicy { typedef HDL::GrowByBytes<2 * 1024 * 1024> Growth; };
+	/// using EntityID = Handle<Entity, void, uint32_t, 1024 * 1024, EntityPolicy>;
+	/// @endcode
+	struct DefaultPolicy
+	{
+		typedef GrowByPages<1> Growth;                                      ///< How the node buffer grows when it's full. See GrowByPages, GrowByBytes and GrowGeometric.
+		static const FreeListMode kFreeListMode = FreeListMode::LockedFifo; ///< How the free indices are stored. See FreeListMode.
+		/// Number of free indices each thread can cache (in its "magazine"), 0 to disable. Not supported with FreeListMode::LockFreeStack.
+		/// Create/Destroy use the calling thread's magazine first, and only lock the pool mutex to exchange batches of kMagazineSize / 2 
+		/// indices with the pool. Indices are reused LIFO inside a magazine (the most recently freed node is probably still in cache).
+		/// A thread's magazine is flushed back to the pool when the thread exits, or explicitely with FlushMagazine().
+		/// Note: Indices cached by other threads can't be used, so Create can fail before MaxHandles is reached.
+		static const size_t kMagazineSize = 0;
+		/// If true, Destroy invalidates the handle immediately but defers the destruction of the element (and the reuse of its index) 
+		/// until all the read sections (see Handle::ReadGuard) that could have seen it have ended. This means the pointers returned by Get
+		/// inside a read section stay valid until the end of the section, even if other threads destroy the elements.
+		/// Deferred destructions are run by batches in Destroy (on whichever thread calls it), or explicitely with Collect(). 
+		/// Until then, they are still counted by Size().
+		static const bool kDeferredDestruction = false;
+		/// If true, the node versions are stored in their own array (parallel to the array of elements) instead of in front of each element.
+		/// Validating a handle (Get, IsValid) then doesn't touch the cache line of the element, bulk validations stream through 
+		/// a dense array of versions, and the alignment of T doesn't pad the version. Costs a second reservation/commit when growing.
+		static const bool kSeparateVersions = false;
+		/// If true, the elements are stored in a DenseHandlePool (slot map) instead of a HandlePool: they are packed contiguously, 
+		/// and destroying one moves the last element in its place. Iterating over all the elements (see Data()) is a linear scan, 
+		/// but the pointers returned by Get are only valid until the next Destroy, and Get must not be called concurrently with Destroy.
+		/// The elements are constructed and destroyed outside of the pool's lock, but moved with the lock held: the move constructor 
+		/// of T, and its destructor when called on a moved-from element, must not use the pool (it would deadlock).
+		/// FreeListMode::LockFreeStack, kMagazineSize, kDeferredDestruction, kSeparateVersions, kRetireSaturatedNodes, kRefCounting 
+		/// kReplaceable, kNodeLocks and kShardCount are not supported.
+		static const bool kDenseStorage = false;
+		/// If true, the pool maintains a bitmap of the allocated nodes (one bit per node, updated by Create/Destroy with an atomic and/or), 
+		/// so that ForEach skips 64 free nodes at a time and costs in proportion to the number of elements rather than the capacity.
+		/// Otherwise ForEach checks the version of every node.
+		static const bool kOccupancyBitmap = false;
+		/// If true, the nodes are stored in chunks of kChunkSize bytes allocated on demand (with operator new) and referenced by 
+		/// a top-level array of pointers, instead of in a range of address space reserved up front for MaxHandles nodes.
+		/// For platforms without HDL::VirtualMemory (handle_win32.cpp/handle_posix.cpp don't need to be compiled then), or processes 
+		/// where big reservations fail or are charged as committed memory (eg. RLIMIT_AS, vm.overcommit_memory=2).
+		/// The chunks never move so Get stays lock-free, but it costs one more indirection. Not supported with kDenseStorage.
+		static const bool kChunkedStorage = false;
+		/// Size of the chunks of kChunkedStorage, in bytes. A chunk holds a power of two number of nodes and is never bigger than this.
+		static const size_t kChunkSize = 64 * 1024;
+		/// If true, the reservations are aligned to the huge page size (see VirtualMemory::GetPageSize) and committed by whole huge pages,
+		/// and the OS is asked to back them with huge pages: transparent huge pages with madvise(MADV_HUGEPAGE) on Linux, or hugetlbfs pages
+		/// if HDL_HUGETLB is defined (they must be preallocated, see vm.nr_hugepages). For pools of millions of elements where random accesses 
+		/// miss the TLB. Commits at least 2 MiB at a time. On Windows, only the commit granularity changes (large pages can't be committed 
+		/// incrementally). Not supported with kChunkedStorage.
+		static const bool kHugePages = false;
+		/// If true, a node whose version is about to wrap around is retired instead: its index is never reused, so a stale handle can't 
+		/// become valid again (no ABA), whatever the churn. Allows narrow handles (eg. 32-bit with 8 bits of version) in long-running 
+		/// processes. Each node can then be used 2^kVersionNumBits - 1 times, after which Create uses the other nodes, and eventually 
+		/// fails once all the nodes up to MaxSize() are retired. The number of retired nodes is returned by RetiredCount().
+		/// Not supported with kDenseStorage.
+		static const bool kRetireSaturatedNodes = false;
+		/// If true, each node has a reference count (4 more bytes in the node header) and elements can be pinned with Acquire/Release 
+		/// (or Handle::Pinned). Destroy invalidates the handle immediately, but the element is only destroyed (and its index reused) 
+		/// when the last pin is released, so a pinned pointer stays valid even if other threads destroy the element. Pinning costs 
+		/// one atomic add and one load, and never locks. Until their destruction, pinned elements are still counted by Size().
+		/// Not supported with kDenseStorage.
+		static const bool kRefCounting = false;
+		/// If true, each node has room for a second element, and Replace can swap the element behind a handle (eg. for hot-reloading)
+		/// while other threads read it: the new element is constructed in the spare slot, then published atomically (the handle doesn't
+		/// change), and the old element is destroyed once the read sections that could have seen it have ended. Requires 
+		/// kDeferredDestruction (the read sections are the grace period). Not supported with kDenseStorage, kRefCounting and TryRead.
+		static const bool kReplaceable = false;
+		/// If true, one more bit of the node version is used as a spinlock, so that elements can be locked with GetLocked instead of
+		/// embedding a mutex in T. GetLocked validates the handle and takes the lock with a single compare-exchange, and Destroy waits 
+		/// until the element is unlocked, so the locked pointer stays valid. Costs nothing in memory unless the version doesn't have 
+		/// a spare bit in its integer (eg. 7 bits of version use a uint16_t instead of a uint8_t). Get/IsValid ignore the lock.
+		/// Not supported with kDenseStorage, kReplaceable and TryRead.
+		static const bool kNodeLocks = false;
+		/// Number of shards (a power of two), or 0 to disable. If greater than 1, the elements are stored in a ShardedHandlePool: 
+		/// the index space is split in kShardCount ranges, each managed by its own HandlePool (reservation, free list, growth and mutex),
+		/// and each thread creates its elements in its own "home" shard (assigned round-robin), so that threads creating and destroying
+		/// their own elements never contend with each other and their elements are on different pages. Destroying an element of
+		/// another shard doesn't lock that shard's mutex either: the index is pushed to the shard's lock-free inbox, which the shard
+		/// uses before growing. Create only uses the other shards when the home shard is full. MaxSize() is split evenly between 
+		/// the shards (the last one holds one less element when MaxSize() is the whole index range, to keep kInvalid out of reach). 
+		/// Only up to 2^32 - 1 handles.
+		/// Not supported with kDenseStorage, kMagazineSize, kDeferredDestruction, kRefCounting and kReplaceable.
+		static const size_t kShardCount = 0;
+		/// Number of bits of the handle (taken from the version) storing the id of the pool that created it, 0 to disable. 
+		/// Required by HDL::Pool: each pool instance gets its own id (the global pool of Handle is 0), and the handles of the other 
+		/// pools of the type are rejected like invalid ones (Get returns nullptr, Destroy returns false, etc.). At most 
+		/// 2^kPoolIdNumBits - 2 pool instances can exist at the same time. Must be 0 or at least 2.
+		static const size_t kPoolIdNumBits = 0;
+	};
+}
+
+template <typename, typename, size_t, typename> class HandlePool;
+template <typename, typename, size_t, typename> class DenseHandlePool;
+template <typename, typename, size_t, typename> class ShardedHandlePool;
 
 template <typename T, typename Tag = void,
 	typename IntegerType = uint32_t,
-	size_t MaxHandles = 64 * 1024
+	size_t MaxHandles = 64 * 1024,
+	typename Policy = HDL::DefaultPolicy
 >
 class Handle
 {
 public:
-	typedef Handle<T, Tag, IntegerType, MaxHandles> this_type;
-	typedef IntegerType                             integer_type; ///< The type of the (unsigned) integer inside the handle.
-	typedef HandlePool<T, IntegerType, MaxHandles>  pool_type;    ///< The type of the pool managing the elements/handles.
+	typedef Handle<T, Tag, IntegerType, MaxHandles, Policy> this_type;
+	typedef IntegerType                                     integer_type; ///< The type of the (unsigned) integer inside the handle.
+	typedef T                                               value_type;   ///< The type of the elements.
+	typedef typename std::conditional<Policy::kDenseStorage,
+		DenseHandlePool<T, IntegerType, MaxHandles, Policy>,
+		typename std::conditional<(Policy::kShardCount > 1),
+		ShardedHandlePool<T, IntegerType, MaxHandles, Policy>,
+		HandlePool<T, IntegerType, MaxHandles, Policy> >::type >::type pool_type; ///< The type of the pool managing the elements/handles.
 
-	static const integer_type kInvalid = pool_type::kInvalid;     ///< Special value reserved for indicating an invalid handle.
+	static constexpr integer_type kInvalid = pool_type::kInvalid; ///< Special value reserved for indicating an invalid handle.
 
 	/// Creates an instance of T and a handle for it. Parameters are forwarded to the element's constructor.
 	/// @returns The handle pointing to the created element, or kInvalid if the allocation failed (MaxHandles reached or out-of-memory).
@@ -46,20 +265,108 @@ public:
 	/// Gets the element pointed by the handle.
 	/// @returns The pointer to the element, or nullptr if the handle was not valid.
 	static T*        Get     (this_type _handle) { return s_pool.get(_handle); }
+	/// Checks if the handle points to an existing element. Only reads the node version (see DefaultPolicy::kSeparateVersions).
+	static bool      IsValid (this_type _handle) { return s_pool.is_valid(_handle); }
+	/// Locks the element pointed by the handle (only available with DefaultPolicy::kNodeLocks), and unlocks it when the returned guard 
+	/// is destroyed. Waits if it is already locked (it's a spinlock, keep the locked sections short). Other threads can still Get it,
+	/// but can't destroy it or lock it until it's unlocked. The lock is not recursive: Destroy or GetLocked of the same handle 
+	/// by the thread that holds the guard waits forever, destroy the guard first.
+	/// @returns The guard, which converts to false if the handle was not valid.
+	/// @code
+	/// if (auto entity = EntityID::GetLocked(id)) entity->m_health -= damage;
+	/// @endcode
+	struct Locked : pool_type::Locked { explicit Locked(this_type _handle) : pool_type::Locked(s_pool, _handle) {} };
+	static Locked    GetLocked(this_type _handle) { return Locked(_handle); }
+	/// Replaces the element pointed by the handle by a new one constructed with `_args`, without changing the handle 
+	/// (only available with DefaultPolicy::kReplaceable). Get returns the new element from now on, the old one is destroyed 
+	/// when the read sections that could have seen it have ended (like with Destroy).
+	/// @returns False if the handle was not valid, or if the previous replacement of this element is still waiting for its destruction.
+	template <class ... Args>
+	static bool      Replace (this_type _handle, Args&&... _args) { return s_pool.replace(_handle, std::forward<Args>(_args)...); }
+	/// Copies the element pointed by the handle to `_out` without any lock, even while other threads destroy it and reuse its node:
+	/// the version is checked before and after the copy (like a seqlock), so the copy is never torn by Destroy/Create.
+	/// T must be trivially copyable. Note: It doesn't protect against the modifications done through the pointer returned by Get,
+	/// and must not be called concurrently with ShrinkToFit (the node could be released during the copy).
+	/// @returns True if the handle was valid during the whole copy, otherwise `_out` is not modified.
+	static bool      TryRead (this_type _handle, T& _out) { return s_pool.try_read(_handle, _out); }
+
+	/// Gets the element pointed by the handle and pins it: it won't be destroyed before Release is called, even if the handle is 
+	/// destroyed in the meantime (only available with DefaultPolicy::kRefCounting).
+	/// @returns The pointer to the element, or nullptr if the handle was not valid (then Release must not be called).
+	static T*        Acquire (this_type _handle) { return s_pool.acquire(_handle); }
+	/// Releases a pin taken by a successful Acquire. Destroys the element if it was destroyed and this was its last pin.
+	static void      Release (this_type _handle) { s_pool.release(_handle); }
+	/// Scoped version of Acquire/Release. Test it before use, it's empty if the handle was not valid.
+	/// @code
+	/// if (EntityID::Pinned entity{ id }) entity->Update();
+	/// @endcode
+	struct Pinned : pool_type::Pinned { explicit Pinned(this_type _handle) : pool_type::Pinned(s_pool, _handle) {} };
+
+	/// Creates `_count` elements (all constructed with the same parameters) and writes their handles to `_outHandles`.
+	/// Cheaper than calling Create in a loop since the pool is only locked once per batch.
+	/// @returns The number of elements created. The remaining handles are set to kInvalid (MaxHandles reached or out-of-memory).
+	template <class ... Args>
+	static size_t    CreateN (this_type* _outHandles, size_t _count, const Args&... _args) { return s_pool.create_n(_outHandles, _count, _args...); }
+	/// Destroys `_count` handles and the pointed elements. Invalid handles are ignored.
+	/// @returns The number of elements destroyed.
+	static size_t    DestroyN(const this_type* _handles, size_t _count)                    { return s_pool.destroy_n(_handles, _count); }
+	/// Gets the elements pointed by `_count` handles and writes them to `_outElements` (nullptr for invalid handles).
+	/// @returns The number of valid handles.
+	static size_t    GetN    (const this_type* _handles, T** _outElements, size_t _count)  { return s_pool.get_n(_handles, _outElements, _count); }
 
 	/// Returns the current number of elements/handles.
 	static size_t    Size    ()                  { return s_pool.size(); }
 	/// Returns the number of elements/handles that can be held in the currently allocated storage.
 	static size_t    Capacity()                  { return s_pool.capacity(); }
-	/// Returns the maximum possible number of elements/handles (ie. MaxHandles).
+	/// Returns the maximum possible number of elements/handles (ie. MaxHandles, or the value passed to Reset).
 	static size_t    MaxSize ()                  { return s_pool.max_size(); }
+	/// Returns the number of nodes retired because their version saturated (see DefaultPolicy::kRetireSaturatedNodes). 
+	/// They are not counted by Size(), but can't be used anymore: at most MaxSize() - RetiredCount() elements can exist.
+	static size_t    RetiredCount()              { return s_pool.retired_count(); }
 
 	/// Reserves storage for at least `_newCap` number of elements/handles.
 	/// @returns The reserve operation success (can fail if _newCap is greater than MaxHandles or if out-of-memory).
 	static bool      Reserve (size_t _newCap)    { return s_pool.reserve(_newCap); }
+	/// Gives the memory of the free nodes at the end of the storage back to the OS (whole pages or chunks), eg. after a load spike.
+	/// Only available with DefaultPolicy::kSeparateVersions or kDenseStorage (which always stores the versions separately): the versions 
+	/// are not released, so the stale handles of the released nodes stay invalid and validating them never reads the released memory. 
+	/// Not available with FreeListMode::LockFreeStack, magazines or kRefCounting. Can be called concurrently with everything but TryRead 
+	/// (which copies the element after validating the handle).
+	/// @returns The number of bytes released.
+	static size_t    ShrinkToFit()               { return s_pool.shrink_to_fit(); }
+
+	/// Starts a read section, which ends when the guard is destroyed (only available with DefaultPolicy::kDeferredDestruction).
+	/// Elements obtained with Get during the read section are not destroyed before it ends. Read sections can be nested.
+	struct ReadGuard : pool_type::ReadGuard { ReadGuard() : pool_type::ReadGuard(s_pool) {} };
+	/// Runs the deferred destructions that are not blocked by read sections anymore (see DefaultPolicy::kDeferredDestruction).
+	/// @returns The number of elements destroyed.
+	static size_t    Collect ()                  { return s_pool.collect(); }
+
+	/// Returns the free indices cached by the calling thread to the pool (see DefaultPolicy::kMagazineSize). 
+	/// This is done automatically when the thread exits.
+	static void      FlushMagazine()             { s_pool.flush_magazine(); }
+
+	/// Calls `_func(T&)` on all the elements. Elements created or destroyed concurrently may or may not be visited, and like with Get,
+	/// nothing prevents other threads from destroying the element during the call (unless it's done in a ReadGuard section).
+	/// The cost depends on the capacity, or on the number of elements with DefaultPolicy::kOccupancyBitmap or kDenseStorage.
+	/// Note: With DefaultPolicy::kDenseStorage, `_func` must not create or destroy elements.
+	template <typename Func>
+	static void      ForEach (Func _func)        { s_pool.for_each(_func); }
+	/// Same as ForEach, but the elements are split in chunks of whole pages that are processed by `_executor` (see HDL::ParallelTask), 
+	/// so `_func` is called concurrently for different elements. Returns when all the elements have been visited.
+	template <typename Func, typename Executor>
+	static void      ParallelForEach(Func _func, Executor&& _executor) { s_pool.parallel_for_each(_func, _executor); }
+
+	/// Returns the packed array of all the elements, of Size() elements (only available with DefaultPolicy::kDenseStorage).
+	/// The pointer is invalidated by Create/Destroy.
+	static T*        Data    ()                  { return s_pool.data(); }
+	/// Returns the handle of the element at `_denseIndex` in Data() (only available with DefaultPolicy::kDenseStorage).
+	static this_type GetHandle(size_t _denseIndex) { return this_type(s_pool.get_handle(_denseIndex)); }
 
 	/// Destoys all the elements, release all the memory.
-	static void      Reset   ();
+	/// `_maxSize` sets the maximum number of elements of the new pool, it can be lowered (eg. from a config file) 
+	/// to reserve less address space than MaxHandles requires. The handle format (index/version bits) depends on MaxHandles only.
+	static void      Reset   (size_t _maxSize = MaxHandles);
 
 	Handle()                              : m_intVal(kInvalid) {}
 	Handle(const this_type& _handle)      : m_intVal(_handle.m_intVal) {}
@@ -78,12 +385,14 @@ namespace HDL
 {
 namespace VirtualMemory
 {
-	size_t GetPageSize();
+	/// Returns the commit granularity: the size of the pages, or of the huge pages if _hugePages is true (eg. 2 MiB on x64).
+	size_t GetPageSize(bool _hugePages = false);
 	/// Reserves a memory area of at least _size bytes. The memory needs to be committed before being used.
-	void*  Reserve (size_t _size);
+	/// If _hugePages is true, the area is aligned to GetPageSize(true) and backed by huge pages where possible (see DefaultPolicy::kHugePages).
+	void*  Reserve (size_t _size, bool _hugePages = false);
 	/// Releases reserved memory. Also decommits any part that was committed.
-	/// _address and _size must match the values returned by/passed to the Reserve call that reserved this memory area.
-	void   Release (void* _address, size_t _size);
+	/// _address, _size and _hugePages must match the values returned by/passed to the Reserve call that reserved this memory area.
+	void   Release (void* _address, size_t _size, bool _hugePages = false);
 	/// Commits reserved memory. All newly allocated pages will contain zeros.
 	/// All the pages containing at least one byte in the range _address, _address + _size will be committed.
 	/// @returns Commit success.
@@ -92,28 +401,336 @@ namespace VirtualMemory
 	/// All the pages containing at least one byte in the range _address, _address + _size will be decommitted.
 	void   Decommit(void* _address, size_t _size);
 }
+
+	/// Array of elements in a range of address space reserved the first time it grows, then committed page by page (or huge page by huge page).
+	/// The elements never move, and the new elements are zeroed. Default storage of HandlePool/DenseHandlePool.
+	template <typename U, bool HugePages = false>
+	class VirtualMemoryArray
+	{
+	public:
+		VirtualMemoryArray() = default;
+		~VirtualMemoryArray() { if (m_data) VirtualMemory::Release(m_data, m_reservedBytes, HugePages); }
+		VirtualMemoryArray(const VirtualMemoryArray&) = delete;
+		VirtualMemoryArray& operator=(const VirtualMemoryArray&) = delete;
+
+		U&     operator[](size_t _index) const { return m_data[_index]; }
+		U*     data    () const                { return m_data; }
+		/// Number of elements in the committed memory.
+		size_t capacity() const                { return m_committedBytes / sizeof(U); }
+
+		/// Commits memory for at least _count elements. The address space for _maxCount elements is reserved the first time.
+		/// @returns False if out of memory or address space.
+		bool   reserve (size_t _count, size_t _maxCount);
+		/// Decommits the pages that are not needed to store _count elements.
+		/// @returns The number of bytes decommitted.
+		size_t shrink  (size_t _count);
+
+		/// Granularity of the commits in bytes.
+		static size_t GetGranularity()           { return VirtualMemory::GetPageSize(HugePages); }
+		/// Number of elements that fit in the memory reserved for _count elements (the rest of the last page can be used too).
+		static size_t GetMaxCount(size_t _count) { return (_count * sizeof(U) + GetGranularity() - 1) / GetGranularity() * GetGranularity() / sizeof(U); }
+
+	private:
+		U*     m_data           = nullptr;
+		size_t m_reservedBytes  = 0;
+		size_t m_committedBytes = 0;
+	};
+
+	/// Array of elements stored in fixed-size chunks that are allocated on demand and found through a top-level array of pointers.
+	/// The elements never move, and the new elements are zeroed. Storage of HandlePool with DefaultPolicy::kChunkedStorage.
+	/// Only the top-level array (one pointer per chunk, for _maxCount elements) is allocated up front.
+	template <typename U, size_t ChunkSizeBytes>
+	class ChunkedArray
+	{
+	public:
+		static constexpr size_t FloorPow2(size_t _x) { return _x < 2 ? 1 : 2 * FloorPow2(_x >> 1); }
+
+		/// Number of elements per chunk. A power of two, so that finding an element is only a shift and a mask.
+		static const size_t kElementsPerChunk = FloorPow2(ChunkSizeBytes / sizeof(U));
+
+		static_assert(ChunkSizeBytes >= sizeof(U), "The chunks must be big enough to hold at least one element.");
+		static_assert(alignof(U) <= alignof(std::max_align_t), "The chunks are allocated with operator new, over-aligned types are not supported.");
+
+		ChunkedArray() = default;
+		~ChunkedArray();
+		ChunkedArray(const ChunkedArray&) = delete;
+		ChunkedArray& operator=(const ChunkedArray&) = delete;
+
+		U&     operator[](size_t _index) const { return m_chunks[_index / kElementsPerChunk][_index % kElementsPerChunk]; }
+		/// Number of elements in the allocated chunks.
+		size_t capacity() const                { return m_numChunks * kElementsPerChunk; }
+
+		/// Allocates chunks for at least _count elements. The top-level array is allocated for _maxCount elements the first time.
+		/// @returns False if out of memory.
+		bool   reserve (size_t _count, size_t _maxCount);
+		/// Frees the chunks that are not needed to store _count elements.
+		/// @returns The number of bytes freed.
+		size_t shrink  (size_t _count);
+
+		/// Granularity of the allocations in bytes.
+		static size_t GetGranularity()           { return kElementsPerChunk * sizeof(U); }
+		/// Number of elements that fit in the chunks needed for _count elements.
+		static size_t GetMaxCount(size_t _count) { return (_count + kElementsPerChunk - 1) / kElementsPerChunk * kElementsPerChunk; }
+
+	private:
+		// Note: A chunk pointer is written before the pool publishes the capacity that covers it (with release semantic),
+		// so reading it doesn't need any synchronization. shrink frees the last chunks and resets their pointers, HandlePool only
+		// shrinks when its versions are stored elsewhere, so that only the elements of valid handles are read from the chunks.
+		U**    m_chunks    = nullptr;
+		size_t m_numChunks = 0;
+		size_t m_maxChunks = 0;
+	};
+}
+
+template <typename U, bool HugePages>
+bool
+HDL::VirtualMemoryArray<U, HugePages>::reserve(size_t _count, size_t _maxCount)
+{
+	HDL_ASSERT(_count <= _maxCount);
+
+	if (_count * sizeof(U) <= m_committedBytes)
+		return true;
+
+	// Reserve the address space if it wasn't done yet
+	if (!m_data)
+	{
+		m_data = (U*)VirtualMemory::Reserve(_maxCount * sizeof(U), HugePages);
+		if (!m_data)
+			return false; // Not enough address space.
+		m_reservedBytes = _maxCount * sizeof(U);
+	}
+
+	// Commit whole pages, they are zeroed by VirtualMemory::Commit.
+	auto pageSize = GetGranularity();
+	size_t nbPages = (_count * sizeof(U) - m_committedBytes + pageSize - 1) / pageSize;
+	if (!VirtualMemory::Commit((char*)m_data + m_committedBytes, nbPages * pageSize))
+		return false; // Out of memory?
+
+	m_committedBytes += nbPages * pageSize;
+	return true;
+}
+
+template <typename U, bool HugePages>
+size_t
+HDL::VirtualMemoryArray<U, HugePages>::shrink(size_t _count)
+{
+	auto pageSize = GetGranularity();
+	size_t neededBytes = (_count * sizeof(U) + pageSize - 1) / pageSize * pageSize;
+	if (neededBytes >= m_committedBytes)
+		return 0;
+
+	// The pages will be zeroed again if they are committed again.
+	size_t decommittedBytes = m_committedBytes - neededBytes;
+	VirtualMemory::Decommit((char*)m_data + neededBytes, decommittedBytes);
+	m_committedBytes = neededBytes;
+
+	return decommittedBytes;
+}
+
+template <typename U, size_t ChunkSizeBytes>
+HDL::ChunkedArray<U, ChunkSizeBytes>::~ChunkedArray()
+{
+	for (size_t i = 0; i < m_numChunks; ++i)
+		::operator delete(m_chunks[i]);
+	delete[] m_chunks;
+}
+
+template <typename U, size_t ChunkSizeBytes>
+bool
+HDL::ChunkedArray<U, ChunkSizeBytes>::reserve(size_t _count, size_t _maxCount)
+{
+	HDL_ASSERT(_count <= _maxCount);
+
+	// Allocate the top-level array if it wasn't done yet. It never grows, so that the chunks can be found without locking.
+	if (!m_chunks)
+	{
+		m_maxChunks = (_maxCount + kElementsPerChunk - 1) / kElementsPerChunk;
+		m_chunks = new (std::nothrow) U*[m_maxChunks];
+		if (!m_chunks)
+			return false;
+	}
+
+	while (capacity() < _count)
+	{
+		HDL_ASSERT(m_numChunks < m_maxChunks);
+
+		void* chunk = ::operator new(kElementsPerChunk * sizeof(U), std::nothrow);
+		if (!chunk)
+			return false; // Out of memory.
+
+		memset(chunk, 0, kElementsPerChunk * sizeof(U));
+		m_chunks[m_numChunks++] = (U*)chunk;
+	}
+
+	return true;
+}
+
+template <typename U, size_t ChunkSizeBytes>
+size_t
+HDL::ChunkedArray<U, ChunkSizeBytes>::shrink(size_t _count)
+{
+	size_t numNeededChunks = (_count + kElementsPerChunk - 1) / kElementsPerChunk;
+	size_t freedBytes = 0;
+
+	while (m_numChunks > numNeededChunks)
+	{
+		::operator delete(m_chunks[--m_numChunks]);
+		m_chunks[m_numChunks] = nullptr;
+		freedBytes += kElementsPerChunk * sizeof(U);
+	}
+
+	return freedBytes;
 }
 
-template <typename T, typename Tag, typename IntegerType, size_t MaxHandles>
-void Handle<T, Tag, IntegerType, MaxHandles>::Reset()
+template <typename T, typename Tag, typename IntegerType, size_t MaxHandles, typename Policy>
+void Handle<T, Tag, IntegerType, MaxHandles, Policy>::Reset(size_t _maxSize)
 {
 	// Call the destructor/constructor explicitely to destroy and recreate the pool
-	s_pool.~HandlePool<T, IntegerType, MaxHandles>();
-	new (&s_pool) HandlePool<T, IntegerType, MaxHandles>();
+	s_pool.~pool_type();
+	new (&s_pool) pool_type(_maxSize);
 }
 
-template <typename T, typename Tag, typename IntegerType, size_t MaxHandles>
-HandlePool<T, IntegerType, MaxHandles> Handle<T, Tag, IntegerType, MaxHandles>::s_pool;
+template <typename T, typename Tag, typename IntegerType, size_t MaxHandles, typename Policy>
+typename Handle<T, Tag, IntegerType, MaxHandles, Policy>::pool_type Handle<T, Tag, IntegerType, MaxHandles, Policy>::s_pool;
+
+namespace HDL
+{
+	/// Pool of elements owned by the user, for when one global pool per handle type is not enough (eg. one pool per level, 
+	/// per worker thread or per test). The pools are independent: they have their own mutex, memory and handle count (up to MaxHandles each),
+	/// and destroying the pool destroys its elements. They use the same handle type as the global pool (Handle::Create etc.),
+	/// and each pool stores its id in the handles it creates (see DefaultPolicy::kPoolIdNumBits, which must be set): a handle 
+	/// used with another pool is rejected like an invalid one.
+	/// @code
+	/// struct EntityPolicy : HDL::DefaultPolicy { static const size_t kPoolIdNumBits = 4; };
+	/// using EntityID = Handle<Entity, void, uint32_t, 1024 * 1024, EntityPolicy>;
+	/// HDL::Pool<EntityID> levelEntities;
+	/// EntityID entity = levelEntities.Create();
+	/// @endcode
+	template <typename HandleType>
+	class Pool
+	{
+	public:
+		typedef HandleType                                       handle_type;
+		typedef typename HandleType::pool_type                   pool_type;
+		typedef typename HandleType::value_type                  value_type;
+
+		static_assert(pool_type::kPoolIdNumBits > 0, "HDL::Pool needs DefaultPolicy::kPoolIdNumBits to tell its handles from the ones of the other pools.");
+
+		/// `_maxSize` can be lower than MaxHandles to reserve less memory (see Handle::Reset).
+		explicit Pool(size_t _maxSize = pool_type::kMaxHandles) : m_pool(_maxSize, m_poolId.m_value) {}
+		Pool(const Pool&) = delete;
+		Pool& operator=(const Pool&) = delete;
+
+		/// Same as the Handle static functions, but for the elements of this pool.
+		template <class ... Args>
+		HandleType  Create  (Args&&... _args)     { return HandleType(m_pool.create(std::forward<Args>(_args)...)); }
+		bool        Destroy (HandleType _handle)  { return m_pool.destroy(_handle); }
+		value_type* Get     (HandleType _handle)  { return m_pool.get(_handle); }
+		bool        IsValid (HandleType _handle) const { return m_pool.is_valid(_handle); }
+		template <class ... Args>
+		bool        Replace (HandleType _handle, Args&&... _args) { return m_pool.replace(_handle, std::forward<Args>(_args)...); }
+		struct Locked : pool_type::Locked { Locked(Pool& _pool, HandleType _handle) : pool_type::Locked(_pool.m_pool, _handle) {} };
+		Locked      GetLocked(HandleType _handle) { return Locked(*this, _handle); }
+		bool        TryRead (HandleType _handle, value_type& _out) const { return m_pool.try_read(_handle, _out); }
+
+		value_type* Acquire (HandleType _handle)  { return m_pool.acquire(_handle); }
+		void        Release (HandleType _handle)  { m_pool.release(_handle); }
+		struct Pinned : pool_type::Pinned { Pinned(Pool& _pool, HandleType _handle) : pool_type::Pinned(_pool.m_pool, _handle) {} };
+
+		template <class ... Args>
+		size_t      CreateN (HandleType* _outHandles, size_t _count, const Args&... _args) { return m_pool.create_n(_outHandles, _count, _args...); }
+		size_t      DestroyN(const HandleType* _handles, size_t _count)                    { return m_pool.destroy_n(_handles, _count); }
+		size_t      GetN    (const HandleType* _handles, value_type** _outElements, size_t _count) { return m_pool.get_n(_handles, _outElements, _count); }
+
+		size_t      Size    () const              { return m_pool.size(); }
+		size_t      Capacity() const              { return m_pool.capacity(); }
+		size_t      MaxSize () const              { return m_pool.max_size(); }
+		size_t      RetiredCount() const          { return m_pool.retired_count(); }
+		bool        Reserve (size_t _newCap)      { return m_pool.reserve(_newCap); }
+		size_t      ShrinkToFit()                 { return m_pool.shrink_to_fit(); }
+
+		struct ReadGuard : pool_type::ReadGuard { explicit ReadGuard(Pool& _pool) : pool_type::ReadGuard(_pool.m_pool) {} };
+		size_t      Collect ()                    { return m_pool.collect(); }
+		void        FlushMagazine()               { m_pool.flush_magazine(); }
+
+		template <typename Func>
+		void        ForEach (Func _func)          { m_pool.for_each(_func); }
+		template <typename Func, typename Executor>
+		void        ParallelForEach(Func _func, Executor&& _executor) { m_pool.parallel_for_each(_func, _executor); }
+
+		value_type* Data    ()                    { return m_pool.data(); }
+		HandleType  GetHandle(size_t _denseIndex) const { return HandleType(m_pool.get_handle(_denseIndex)); }
+
+		/// Destroys all the elements, releases all the memory.
+		void        Reset   (size_t _maxSize = pool_type::kMaxHandles) { m_pool.~pool_type(); new (&m_pool) pool_type(_maxSize, m_poolId.m_value); }
+
+	private:
+		// Ids of the live pools of the handle type (0 is the global pool of Handle).
+		struct PoolIdAllocator
+		{
+			HDL_MUTEX         m_mutex;
+			HDL_DEQUE<size_t> m_freeIds;
+			size_t            m_nextId = 1;
+
+			static PoolIdAllocator& Get() { static PoolIdAllocator s_allocator; return s_allocator; }
+		};
+
+		// Declared before m_pool: the id is released after the pool is destroyed.
+		struct PoolId
+		{
+			size_t m_value;
+
+			PoolId()
+			{
+				auto& allocator = PoolIdAllocator::Get();
+				allocator.m_mutex.lock();
+				// Fresh ids first, then the oldest freed one: the stale handles of a destroyed pool would be valid in the pool
+				// that reuses its id (same as the versions of the nodes), so the reuse is delayed as long as possible.
+				if (allocator.m_nextId <= pool_type::kMaxPoolId)
+				{
+					m_value = allocator.m_nextId++;
+				}
+				else if (!allocator.m_freeIds.empty())
+				{
+					m_value = allocator.m_freeIds.front();
+					allocator.m_freeIds.pop_front();
+				}
+				else
+				{
+					HDL_ASSERT(false, "Too many pools of this handle type, increase DefaultPolicy::kPoolIdNumBits.");
+					m_value = 0; // Shares the id of the global pool, its handles are not told apart anymore.
+				}
+				allocator.m_mutex.unlock();
+			}
+
+			~PoolId()
+			{
+				if (m_value == 0)
+					return;
+
+				auto& allocator = PoolIdAllocator::Get();
+				allocator.m_mutex.lock();
+				allocator.m_freeIds.push_back(m_value);
+				allocator.m_mutex.unlock();
+			}
+		};
+
+		PoolId    m_poolId;
+		pool_type m_pool;
+	};
+}
 
-template <typename T, typename IntegerType, size_t MaxHandles>
+template <typename T, typename IntegerType, size_t MaxHandles, typename Policy>
 class HandlePool
 {
 public:
-	typedef HandlePool<T, IntegerType, MaxHandles> this_type;
-	typedef IntegerType                            integer_type;
-	static const integer_type kInvalid = ~0;
+	typedef HandlePool<T, IntegerType, MaxHandles, Policy> this_type;
+	typedef IntegerType                                    integer_type;
+	static constexpr integer_type kInvalid = (integer_type)~0;
 
-	HandlePool() = default;
+	HandlePool() : HandlePool(kMaxHandles) {}
+	/// `_poolId` is encoded in the handles (see Policy::kPoolIdNumBits), the handles of other ids are rejected. 0 is the global pool.
+	explicit HandlePool(size_t _maxHandles, size_t _poolId = 0);
 	~HandlePool();
 	
 	HandlePool(const this_type&) = delete;
@@ -123,12 +740,49 @@ public:
 	integer_type create  (Args&&... _args);
 	bool         destroy (integer_type _handle);
 	T*           get     (integer_type _handle);
-
-	size_t       size    () const { return m_handleCount; }
-	size_t       capacity() const { return MinSizeT(m_nodeBufferCapacityBytes / sizeof(Node), kMaxHandles); }
-	size_t       max_size() const { return kMaxHandles; }
+	bool         is_valid(integer_type _handle) const;
+	bool         try_read(integer_type _handle, T& _out) const;
+	template <class ... Args>
+	bool         replace (integer_type _handle, Args&&... _args);
+
+	// Per-element lock (see Policy::kNodeLocks).
+	T*           lock    (integer_type _handle);
+	void         unlock  (integer_type _handle);
+	class Locked;
+
+	// Pins (see Policy::kRefCounting).
+	T*           acquire (integer_type _handle);
+	void         release (integer_type _handle);
+	class Pinned;
+
+	// Batch versions, they only lock the mutex once per kBatchSize handles.
+	// HandleType can be integer_type or any type that converts to/from integer_type (eg. Handle).
+	template <typename HandleType, class ... Args>
+	size_t       create_n (HandleType* _outHandles, size_t _count, const Args&... _args);
+	template <typename HandleType>
+	size_t       destroy_n(const HandleType* _handles, size_t _count);
+	template <typename HandleType>
+	size_t       get_n    (const HandleType* _handles, T** _outElements, size_t _count);
+
+	static const size_t kBatchSize = 256;
+
+	size_t       size    () const { return m_handleCount.load(std::memory_order_relaxed); }
+	size_t       capacity() const { return MinSizeT(m_nodeBufferCapacityBytes.load(std::memory_order_relaxed) / sizeof(Node), m_maxHandles); }
+	size_t       max_size() const { return m_maxHandles; }
+	size_t       retired_count() const { return m_retiredCount.load(std::memory_order_relaxed); }
 
 	bool         reserve (size_t _newCap);
+	size_t       shrink_to_fit();
+
+	void         flush_magazine();
+	size_t       collect ();
+
+	template <typename Func>
+	void         for_each(Func _func);
+	template <typename Func, typename Executor>
+	void         parallel_for_each(Func _func, Executor& _executor);
+
+	class ReadGuard;
 
 	static constexpr size_t MinSizeT(size_t _a, size_t _b) { return _a < _b ? _a : _b; } // Don't want to include <algorithm> just for std::min
 	static constexpr size_t CeilLog2(size_t _x)            { return _x < 2 ? 1 : 1 + CeilLog2(_x >> 1); }
@@ -136,11 +790,16 @@ public:
 	static const size_t kMaxHandles     = MaxHandles;
 	static const size_t kIndexNumBits   = CeilLog2(MaxHandles - 1);
 	static const size_t kIndexMask      = ((size_t)1 << kIndexNumBits) - 1;
-	static const size_t kVersionNumBits = MinSizeT(sizeof(IntegerType) * 8 - kIndexNumBits, sizeof(size_t) * 8 - 1); // The version is stored in a size_t minus 1 bit below.
+	static const size_t kPoolIdNumBits  = Policy::kPoolIdNumBits;
+	static const size_t kPoolIdMask     = ((size_t)1 << kPoolIdNumBits) - 1;
+	static const size_t kMaxPoolId      = kPoolIdNumBits > 0 ? kPoolIdMask - 1 : 0; // The id with all the bits set is never used, kInvalid has it.
+	static const size_t kVersionNumBits = MinSizeT(sizeof(IntegerType) * 8 - kIndexNumBits - kPoolIdNumBits, sizeof(uint64_t) * 8 - 1); // The version is stored with an extra bit below.
 	static const size_t kVersionMask    = ((size_t)1 << kVersionNumBits) - 1;
+	static const size_t kPoolIdShift    = kIndexNumBits + kVersionNumBits;
 
 	static_assert(std::is_integral<IntegerType>::value && std::is_unsigned<IntegerType>::value, "IntegerType must be an unsigned integer type.");
-	static_assert(kIndexNumBits < sizeof(IntegerType) * 8, "There are not enough bits in IntegerType to store both index and version.");
+	static_assert(kIndexNumBits + kPoolIdNumBits < sizeof(IntegerType) * 8, "There are not enough bits in IntegerType to store the index, the version and the pool id.");
+	static_assert(kPoolIdNumBits != 1, "DefaultPolicy::kPoolIdNumBits must be 0 or at least 2 (the id with all the bits set is never used).");
 	
 	// Choose the smallest index type that can fit the wanted number of bits.
 	typedef typename std::conditional< kIndexNumBits <= 16, uint16_t,
@@ -148,9 +807,14 @@ public:
 
 	static index_type   GetIndex  (integer_type _handle);
 	static size_t       GetVersion(integer_type _handle);
+	static size_t       GetPoolId (integer_type _handle);
 	static integer_type GetID     (index_type _index, size_t _version);
+	static integer_type GetID     (index_type _index, size_t _version, size_t _poolId);
 
 private:
+	template <typename, typename, size_t, typename> friend class DenseHandlePool; // Shares LockGuard.
+	template <typename, typename, size_t, typename> friend class ShardedHandlePool; // Uses the inbox.
+
 	struct LockGuard
 	{
 		HDL_MUTEX& m_mutex;
@@ -160,230 +824,2522 @@ private:
 	};
 
 	size_t getNodeBufferSize() const;
+	HDL_NO_SANITIZE_THREAD void assertIndexInRange(index_type _index) const;
 	bool   reserveNoLock(size_t _newCap);
+	bool   growNoLock(size_t _minNumNodes = 1);
+	size_t reserveHandleCount(size_t _count);
+	bool   invalidateHandle(integer_type _handle, index_type& _outIndex);
+	template <class ... Args>
+	integer_type constructNode(index_type _index, Args&&... _args);
+	bool   allocateIndex(index_type& _outIndex);
+	size_t allocateIndicesNoLock(index_type* _outIndices, size_t _count);
+	bool   allocateIndexAtEnd(index_type& _outIndex);
+	bool   allocateIndexFromMagazine(index_type& _outIndex);
+	void   freeIndexToMagazine(index_type _index);
+
+	// The node version is stored shifted left by one bit, the low bit is set while the node is allocated (odd = live).
+	// It is only modified with release semantic once the element is constructed (in create), 
+	// or with a compare-exchange before it is destroyed (in destroy), so get only needs a single acquire load 
+	// (a plain load on x86) and comparison to validate a handle.
+	static const size_t kAllocatedBit = 1;
+
+	static const bool kSeparateVersions = Policy::kSeparateVersions;
+
+	// With Policy::kNodeLocks, the highest bit of the node version is the lock (set while locked, only on allocated nodes).
+	static const bool   kNodeLocks    = Policy::kNodeLocks;
+	static const size_t kLockNumBits  = kNodeLocks ? 1 : 0;
+	static_assert(kVersionNumBits + 1 + kLockNumBits <= 64, "There are not enough bits in IntegerType to store the version and the lock of the nodes.");
+
+	// Choose the smallest types that can fit the node version (kVersionNumBits + the allocated bit + the lock bit) and the free list link (an index or kEmptyLink),
+	// so that small elements are not padded by a header bigger than needed (eg. 8 bytes instead of 16 per node for an int with uint16_t handles).
+	typedef typename std::conditional< kVersionNumBits + kLockNumBits < 8, uint8_t,
+		typename std::conditional<kVersionNumBits + kLockNumBits < 16, uint16_t,
+		typename std::conditional<kVersionNumBits + kLockNumBits < 32, uint32_t, uint64_t>::type >::type >::type NodeVersionType;
+
+	static const NodeVersionType kLockBit = (NodeVersionType)(kLockNumBits << (sizeof(NodeVersionType) * 8 - 1));
+	typedef typename std::conditional< kIndexNumBits < 8, uint8_t,
+		typename std::conditional<kIndexNumBits < 16, uint16_t, uint32_t>::type >::type FreeLinkType;
+	typedef std::atomic<NodeVersionType> NodeVersion;
+
+	static const FreeLinkType kEmptyLink = (FreeLinkType)~0;
+
+	// Reference count of the node, only used with Policy::kRefCounting: 1 for the creation (dropped by destroy) + 1 per pin, 
+	// plus kPendingDestroyBit once the handle is destroyed. The element is destroyed by whoever brings it to kPendingDestroyBit.
+	// Pin attempts with stale handles also increment it temporarily (they can't know it's stale before), even on free nodes.
+	static const bool     kRefCounting       = Policy::kRefCounting;
+	static const uint32_t kPendingDestroyBit = 0x80000000u;
+
+	struct RefCountedNodeHeader { std::atomic<uint32_t> m_refCount; };
+	struct EmptyNodeHeader {};
+
+	// Second slot of the node, only used with Policy::kReplaceable. The slot state says which slot holds the current element 
+	// (kActiveSlotBit), if the other one is in use (kSpareBusyBit: the new element is being constructed, or the replaced one waits 
+	// for its destruction), and if the node was destroyed meanwhile (kDestroyedBit: the destruction of the replaced element frees the node).
+	static const bool     kReplaceable   = Policy::kReplaceable;
+	static const uint32_t kActiveSlotBit = 1;
+	static const uint32_t kSpareBusyBit  = 2;
+	static const uint32_t kDestroyedBit  = 4;
+
+	struct ReplaceableNodeHeader
+	{
+		std::atomic<uint32_t> m_slotState;
+		union
+		{
+			T                 m_spareValue;
+		};
+	};
 
-	struct Node
+	typedef typename std::conditional<kReplaceable, ReplaceableNodeHeader, 
+		typename std::conditional<kRefCounting, RefCountedNodeHeader, EmptyNodeHeader>::type >::type NodeHeader;
+
+	struct VersionedNode : NodeHeader
 	{
-		size_t m_allocated : 1;
-		size_t m_version   : sizeof(size_t) * 8 - 1; // = 63 bits on 64 bits systems.
-		T      m_value;
+		NodeVersion m_version; // (version << 1) | allocated
+		union
+		{
+			T                         m_value;
+			std::atomic<FreeLinkType> m_nextFreeIndex; // Only used by LockFreeStackFreeList, while the node is free.
+		};
 	};
 
-	// The max value m_nodeBufferSizeBytes can take to keep its indexable with kIndexNumBits
-	static const size_t kNodeBufferMaxSizeBytes = (1 << kIndexNumBits) * sizeof(Node);
+	// Node without version, used with Policy::kSeparateVersions. The versions are in m_versions instead.
+	struct UnversionedNode : NodeHeader
+	{
+		union
+		{
+			T                         m_value;
+			std::atomic<FreeLinkType> m_nextFreeIndex;
+		};
+	};
 
-	Node*                   m_nodeBuffer              = nullptr;
-	size_t                  m_nodeBufferSizeBytes     = 0;
-	size_t                  m_nodeBufferCapacityBytes = 0;
-	size_t                  m_handleCount             = 0;
-	HDL_DEQUE<index_type>   m_freeIndices;
-	HDL_MUTEX               m_mutex;
-};
+	typedef typename std::conditional<kSeparateVersions, UnversionedNode, VersionedNode>::type Node;
 
-template <typename T, typename IntegerType, size_t MaxHandles>
-HandlePool<T, IntegerType, MaxHandles>::~HandlePool()
-{
-	// Destroy all the allocated nodes
-	size_t nodeCount = getNodeBufferSize();
-	for (size_t i = 0; i < nodeCount; ++i)
+	// Storage of the nodes and of the side arrays (see Policy::kChunkedStorage). 
+	template <typename U>
+	using Array = typename std::conditional<Policy::kChunkedStorage, HDL::ChunkedArray<U, Policy::kChunkSize>, HDL::VirtualMemoryArray<U, Policy::kHugePages> >::type;
+
+	static_assert(!Policy::kChunkedStorage || !Policy::kHugePages, "Huge pages are not supported with chunked storage.");
+
+	static NodeVersion& GetNodeVersion(const Array<VersionedNode>& _nodes, const Array<NodeVersion>& /*_versions*/, size_t _index) { return _nodes[_index].m_version; }
+	static NodeVersion& GetNodeVersion(const Array<UnversionedNode>& /*_nodes*/, const Array<NodeVersion>& _versions, size_t _index) { return _versions[_index]; }
+
+	NodeVersion& nodeVersion(size_t _index) const { return GetNodeVersion(m_nodes, m_versions, _index); }
+
+	static std::atomic<uint32_t>& GetNodeRefCount(Node& _node, std::true_type)        { return _node.m_refCount; }
+	static std::atomic<uint32_t>& GetNodeRefCount(Node& /*_node*/, std::false_type)   { HDL_ASSERT(false, "Only available with Policy::kRefCounting."); static std::atomic<uint32_t> unused; return unused; }
+
+	std::atomic<uint32_t>& nodeRefCount(size_t _index) const { return GetNodeRefCount(m_nodes[_index], std::integral_constant<bool, kRefCounting>()); }
+	bool   releaseNodeRef(index_type _index, bool _destroyed);
+
+	typedef std::integral_constant<bool, kReplaceable> ReplaceableTag;
+	static T& GetNodeValue(Node& _node, uint32_t _slot, std::true_type)   { return _slot == 0 ? _node.m_value : _node.m_spareValue; }
+	static T& GetNodeValue(Node& _node, uint32_t /*_slot*/, std::false_type) { return _node.m_value; }
+	static std::atomic<uint32_t>& GetSlotState(Node& _node, std::true_type)   { return _node.m_slotState; }
+	static std::atomic<uint32_t>& GetSlotState(Node& /*_node*/, std::false_type) { HDL_ASSERT(false, "Only available with Policy::kReplaceable."); static std::atomic<uint32_t> unused; return unused; }
+
+	std::atomic<uint32_t>& nodeSlotState(size_t _index) const { return GetSlotState(m_nodes[_index], ReplaceableTag()); }
+	T&     nodeValue(size_t _index, uint32_t _slot) const { return GetNodeValue(m_nodes[_index], _slot, ReplaceableTag()); }
+	// The current element of the node. seq_cst like the version load in get, Replace relies on the read sections (see ReadGuard).
+	T&     nodeValue(size_t _index) const { return nodeValue(_index, kReplaceable ? nodeSlotState(_index).load(std::memory_order_seq_cst) & kActiveSlotBit : 0); }
+	bool   releaseReplacedSlot(index_type _index);
+	bool   markReplaceableNodeDestroyed(index_type _index);
+
+	// Copies an element that may be concurrently destroyed and reused (see try_read), the result is only used if it wasn't.
+	// Volatile word loads rather than memcpy, which ThreadSanitizer intercepts whatever the attributes of the caller.
+	static HDL_NO_SANITIZE_THREAD void CopyRacy(void* _dest, const T& _value)
 	{
-		auto node = m_nodeBuffer + i;
-		if (node->m_allocated)
-			node->m_value.~T();
+		typedef typename std::conditional<alignof(T) % 8 == 0 && sizeof(T) % 8 == 0, uint64_t,
+			typename std::conditional<alignof(T) % 4 == 0 && sizeof(T) % 4 == 0, uint32_t,
+			typename std::conditional<alignof(T) % 2 == 0 && sizeof(T) % 2 == 0, uint16_t, uint8_t>::type >::type >::type Word;
+
+		const volatile Word* src = reinterpret_cast<const volatile Word*>(&_value);
+		for (size_t i = 0; i < sizeof(T) / sizeof(Word); ++i)
+		{
+			Word word = src[i];
+			memcpy((char*)_dest + i * sizeof(Word), &word, sizeof(Word));
+		}
 	}
 
-	// Release the reserved memory
-	if (m_nodeBuffer)
-		HDL::VirtualMemory::Release(m_nodeBuffer, kMaxHandles * sizeof(Node));
-}
+	// One bit per node, set while the node is allocated. Only used with Policy::kOccupancyBitmap.
+	static const bool   kOccupancyBitmap   = Policy::kOccupancyBitmap;
 
-template <typename T, typename IntegerType, size_t MaxHandles>
-template <class ... Args>
-IntegerType
-HandlePool<T, IntegerType, MaxHandles>::create(Args&&... _args)
-{
-	index_type index;
+	void   setOccupied(size_t _index, bool _occupied);
 
+	template <typename Func>
+	void   forEachInRange(size_t _begin, size_t _end, Func& _func);
+
+	// FIFO (or LIFO with FreeListMode::LockedLifo) of free indices. Must only be used with m_mutex locked.
+	struct LockedDequeFreeList
 	{
-		LockGuard guard(m_mutex);
+		HDL_DEQUE<index_type> m_indices;
+
+		bool pop(this_type& /*_pool*/, index_type& _outIndex)
+		{
+			if (m_indices.empty())
+				return false;
 
-		if (m_handleCount == kMaxHandles)
-			return kInvalid;
+			if (kLifoFreeList)
+			{
+				_outIndex = m_indices.back();
+				m_indices.pop_back();
+			}
+			else
+			{
+				_outIndex = m_indices.front();
+				m_indices.pop_front();
+			}
+			return true;
+		}
+
+		void push(this_type& /*_pool*/, index_type _index) { m_indices.push_back(_index); }
 
-		// If there is enough space in the node buffer, add a node
-		// Note: use the rest of the buffer before looking for free indices to delay the wrapping of the versions as much as possible
-		if (m_nodeBufferSizeBytes < kNodeBufferMaxSizeBytes
-			&& (m_nodeBufferSizeBytes + sizeof(Node)) <= m_nodeBufferCapacityBytes)
+		template <typename Func>
+		void for_each(this_type& /*_pool*/, Func _func) { for (index_type index : m_indices) _func(index); }
+
+		// Removes all the indices >= _begin.
+		void remove_from(this_type& /*_pool*/, size_t _begin)
 		{
-			index = (index_type)getNodeBufferSize();
-			m_nodeBufferSizeBytes += sizeof(Node);
+			for (size_t i = 0, count = m_indices.size(); i < count; ++i)
+			{
+				index_type index = m_indices.front();
+				m_indices.pop_front();
+				if (index < _begin)
+					m_indices.push_back(index);
+			}
 		}
-		// Otherwise look for free indices
-		else if (!m_freeIndices.empty())
+	};
+
+	// Free indices grouped by page, the pages with the fewest free nodes are used first (see FreeListMode::LockedFullestPage).
+	// Must only be used with m_mutex locked. Each page has a stack of its free indices, threaded through its free nodes (like LockFreeStackFreeList),
+	// and the pages that have free nodes are in doubly-linked lists (buckets) indexed by their number of free nodes.
+	struct LockedFullestPageFreeList
+	{
+		static const size_t kNone = ~(size_t)0;
+
+		struct Page
 		{
-			index = m_freeIndices.front();
-			m_freeIndices.pop_front();
+			size_t m_freeCount = 0;
+			size_t m_firstFree = kNone; // Top of the stack of free indices.
+			size_t m_prev      = kNone; // Pages with the same number of free nodes.
+			size_t m_next      = kNone;
+		};
+
+		size_t            m_pageSize     = 0; // Granularity of the node buffer (pages, or chunks).
+		size_t            m_minBucket    = 0; // There is no page in the buckets below this one.
+		HDL_DEQUE<Page>   m_pages;
+		HDL_DEQUE<size_t> m_buckets;          // First page of each bucket, the index is the number of free nodes.
+
+		bool pop(this_type& _pool, index_type& _outIndex)
+		{
+			while (m_minBucket < m_buckets.size() && m_buckets[m_minBucket] == kNone)
+				m_minBucket++;
+			if (m_minBucket >= m_buckets.size())
+				return false;
+
+			size_t pageIndex = m_buckets[m_minBucket];
+			Page& page = m_pages[pageIndex];
+
+			_outIndex = (index_type)page.m_firstFree;
+			FreeLinkType next = _pool.m_nodes[_outIndex].m_nextFreeIndex.load(std::memory_order_relaxed);
+			page.m_firstFree = next == kEmptyLink ? kNone : next;
+
+			unlink(pageIndex);
+			page.m_freeCount--;
+			link(pageIndex);
+			return true;
 		}
-		// Last option, grow the node buffer
-		else
+
+		void push(this_type& _pool, index_type _index)
 		{
-			HDL_ASSERT(m_nodeBufferSizeBytes < kNodeBufferMaxSizeBytes); // At this point, either the freelist should not be empty, 
-																		 // or we should have reached kMaxHandles and returned kInvalid
+			if (m_pageSize == 0)
+			{
+				// A page holds at most this many nodes (or the beginning of them), they can straddle two pages when sizeof(Node) 
+				// doesn't divide the page size.
+				m_pageSize = Array<Node>::GetGranularity();
+				m_buckets.resize((m_pageSize + sizeof(Node) - 1) / sizeof(Node) + 1, (size_t)kNone);
+			}
 
-			// Increase capacity to store at least one more node.
-			// FIXME! Not the best idea if nodes are very big, make alloc size customizable?
-			auto cap = capacity();
-			if (!reserveNoLock(cap + 1))
+			size_t pageIndex = getPageIndex(_index);
+			while (m_pages.size() <= pageIndex)
+				m_pages.emplace_back();
+
+			Page& page = m_pages[pageIndex];
+			_pool.m_nodes[_index].m_nextFreeIndex.store(page.m_firstFree == kNone ? kEmptyLink : (FreeLinkType)page.m_firstFree, std::memory_order_relaxed);
+			page.m_firstFree = _index;
+
+			unlink(pageIndex);
+			page.m_freeCount++;
+			link(pageIndex);
+		}
+
+		template <typename Func>
+		void for_each(this_type& _pool, Func _func)
+		{
+			for (auto& page : m_pages)
 			{
-				// Reserve failed, probably out-of-memory.
-				return kInvalid;
+				for (size_t index = page.m_firstFree; index != kNone; )
+				{
+					FreeLinkType next = _pool.m_nodes[index].m_nextFreeIndex.load(std::memory_order_relaxed);
+					_func((index_type)index);
+					index = next == kEmptyLink ? kNone : next;
+				}
 			}
+		}
 
-			index = (index_type)getNodeBufferSize();
-			m_nodeBufferSizeBytes += sizeof(Node);
+		// Removes all the indices >= _begin.
+		void remove_from(this_type& _pool, size_t _begin)
+		{
+			for (size_t pageIndex = m_pageSize ? getPageIndex(_begin) : m_pages.size(); pageIndex < m_pages.size(); ++pageIndex)
+			{
+				Page& page = m_pages[pageIndex];
+				if (page.m_freeCount == 0)
+					continue;
+
+				unlink(pageIndex);
+
+				size_t index = page.m_firstFree;
+				page.m_firstFree = kNone;
+				page.m_freeCount = 0;
+				while (index != kNone)
+				{
+					FreeLinkType next = _pool.m_nodes[index].m_nextFreeIndex.load(std::memory_order_relaxed);
+					if (index < _begin)
+					{
+						_pool.m_nodes[index].m_nextFreeIndex.store(page.m_firstFree == kNone ? kEmptyLink : (FreeLinkType)page.m_firstFree, std::memory_order_relaxed);
+						page.m_firstFree = index;
+						page.m_freeCount++;
+					}
+					index = next == kEmptyLink ? kNone : next;
+				}
+
+				link(pageIndex);
+			}
 		}
 
-		m_handleCount++;
+	private:
+		// The page that contains the beginning of the node.
+		size_t getPageIndex(size_t _index) const { return _index * sizeof(Node) / m_pageSize; }
 
-	} // LockGuard end
+		void link(size_t _pageIndex)
+		{
+			Page& page = m_pages[_pageIndex];
+			if (page.m_freeCount == 0)
+				return;
+
+			page.m_prev = kNone;
+			page.m_next = m_buckets[page.m_freeCount];
+			if (page.m_next != kNone)
+				m_pages[page.m_next].m_prev = _pageIndex;
+			m_buckets[page.m_freeCount] = _pageIndex;
+
+			if (page.m_freeCount < m_minBucket)
+				m_minBucket = page.m_freeCount;
+		}
 
-	auto node = m_nodeBuffer + index;
-	node->m_allocated = true;
-	new (&node->m_value) T(std::forward<Args>(_args)...);
+		void unlink(size_t _pageIndex)
+		{
+			Page& page = m_pages[_pageIndex];
+			if (page.m_freeCount == 0)
+				return;
+
+			if (page.m_prev != kNone)
+				m_pages[page.m_prev].m_next = page.m_next;
+			else
+				m_buckets[page.m_freeCount] = page.m_next;
+			if (page.m_next != kNone)
+				m_pages[page.m_next].m_prev = page.m_prev;
+		}
+	};
 
-	return GetID(index, node->m_version);
-}
+	// Intrusive lock-free stack (Treiber stack) of free indices. The link to the next free index is stored in the free nodes, in place of m_value.
+	// The head is an {index, tag} pair, the tag is incremented by every operation to avoid the ABA problem.
+	// Note: pop may read the link of a node that was just popped by another thread (and is being constructed),
+	// but in that case the tag has changed and the compare-exchange fails, so that value is never used.
+	struct LockFreeStackFreeList
+	{
+		static const uint64_t kEmpty   = 0xFFFFFFFF;
+		static const uint64_t kTagUnit = (uint64_t)1 << 32;
 
-template<typename T, typename IntegerType, size_t MaxHandles>
-bool
-HandlePool<T, IntegerType, MaxHandles>::destroy(integer_type _handle)
-{
-	if (_handle == kInvalid)
-		return false;
+		std::atomic<uint64_t> m_head { kEmpty };
 
-	index_type index = GetIndex(_handle);
-	size_t version = GetVersion(_handle);
+		// The node may be concurrently popped and constructed by another thread, see above.
+		static HDL_NO_SANITIZE_THREAD uint64_t LoadNextFreeIndex(const Node& _node) 
+		{ 
+			FreeLinkType link = _node.m_nextFreeIndex.load(std::memory_order_relaxed);
+			return link == kEmptyLink ? kEmpty : link; 
+		}
+
+		bool pop(this_type& _pool, index_type& _outIndex)
+		{
+			uint64_t head = m_head.load(std::memory_order_acquire);
+			for (;;)
+			{
+				uint64_t index = head & kEmpty;
+				if (index == kEmpty)
+					return false;
+
+				uint64_t next = LoadNextFreeIndex(_pool.m_nodes[index]);
+				uint64_t newHead = ((head & ~kEmpty) + kTagUnit) | next;
+
+				if (m_head.compare_exchange_weak(head, newHead, std::memory_order_acquire, std::memory_order_acquire))
+				{
+					_outIndex = (index_type)index;
+					return true;
+				}
+			}
+		}
 
-	HDL_ASSERT(index < getNodeBufferSize());
-	auto node = m_nodeBuffer + index;
+		void push(this_type& _pool, index_type _index)
+		{
+			auto& node = _pool.m_nodes[_index];
+			uint64_t head = m_head.load(std::memory_order_relaxed);
+			uint64_t newHead;
+			do 
+			{
+				node.m_nextFreeIndex.store((FreeLinkType)(head & kEmpty), std::memory_order_relaxed); // kEmpty becomes kEmptyLink
+				newHead = ((head & ~kEmpty) + kTagUnit) | _index;
+			} while (!m_head.compare_exchange_weak(head, newHead, std::memory_order_release, std::memory_order_relaxed));
+		}
+	};
 
-	if (node->m_version != version)
-		return false; // The handle was already destroyed.
+	static const bool kLockFreeFreeList = Policy::kFreeListMode == HDL::FreeListMode::LockFreeStack;
+	static const bool kPageAwareFreeList = Policy::kFreeListMode == HDL::FreeListMode::LockedFullestPage;
+	static const bool kLifoFreeList      = Policy::kFreeListMode == HDL::FreeListMode::LockedLifo;
+	static_assert(!kLockFreeFreeList || kIndexNumBits < 32, "FreeListMode::LockFreeStack only supports up to 2^32 - 1 handles.");
+	static_assert(!kPageAwareFreeList || kIndexNumBits < 32, "FreeListMode::LockedFullestPage only supports up to 2^32 - 1 handles.");
+
+	typedef typename std::conditional<kLockFreeFreeList, LockFreeStackFreeList, 
+		typename std::conditional<kPageAwareFreeList, LockedFullestPageFreeList, LockedDequeFreeList>::type >::type FreeList;
+
+	static const size_t kMagazineSize      = Policy::kMagazineSize;
+	static const size_t kMagazineBatchSize = kMagazineSize > 1 ? kMagazineSize / 2 : 1;
+	static_assert(kMagazineSize == 0 || !kLockFreeFreeList, "Magazines are not supported with FreeListMode::LockFreeStack.");
+
+	static const bool   kDeferredDestruction      = Policy::kDeferredDestruction;
+	static_assert(!Policy::kReplaceable || kDeferredDestruction, "Replace needs DefaultPolicy::kDeferredDestruction, the read sections are its grace period.");
+	static_assert(!Policy::kReplaceable || !Policy::kRefCounting, "Pins are not supported with replaceable elements.");
+	static_assert(!Policy::kReplaceable || !Policy::kNodeLocks, "Node locks are not supported with replaceable elements.");
+	static const bool   kRetireSaturatedNodes     = Policy::kRetireSaturatedNodes;
+
+	// With kRetireSaturatedNodes, the last version of a node is never given to a handle: a node holding it is retired.
+	// It is kVersionMask, except for the last index where it's kVersionMask - 1 (the max version would make the handle equal to kInvalid).
+	static size_t GetRetiredVersion(index_type _index) { return GetID(_index, kVersionMask) == kInvalid ? kVersionMask - 1 : kVersionMask; }
+	bool   isRetired(index_type _index) const { return kRetireSaturatedNodes && (nodeVersion(_index).load(std::memory_order_relaxed) >> 1) == GetRetiredVersion(_index); }
+	static const size_t kDeferredDestructionBatch = 64; // Number of deferred destructions that triggers a collect.
+
+	// Thread-local data. There is one per thread and per pool, attached the first time the thread uses the pool (the ones detached
+	// from destroyed pools are reused). Each thread keeps the thread data of all the pools it used in its ThreadDataList (linked by m_nextInThread), and each pool
+	// keeps a list of the thread data attached to it, to be able to detach them when it is destroyed and to find the read sections in progress.
+	struct ThreadData
+	{
+		this_type*            m_pool          = nullptr;
+		ThreadData*           m_prev          = nullptr; // List of the threads of the pool.
+		ThreadData*           m_next          = nullptr;
+		ThreadData*           m_nextInThread  = nullptr; // List of the pools of the thread.
 
-	node->m_version++;
-	// Force the version to wrap around to make sure it doesn't use more than VersionNumBits (otherwise the equality test would fail).
-	node->m_version &= kVersionMask;
+		// Cache of free indices (see Policy::kMagazineSize).
+		size_t                m_magazineCount = 0;
+		index_type            m_magazine[kMagazineSize > 0 ? kMagazineSize : 1];
 
-	// Special case for the last index: it cannot use the max version, otherwise the handle would be equal to kInvalid.
-	// In this case, wrap around sooner.
-	if (GetID(index, node->m_version) == kInvalid)
-		node->m_version = 0;
+		// Epoch at which the current read section started, or 0 outside of read sections (see Policy::kDeferredDestruction).
+		std::atomic<uint64_t> m_readEpoch     { 0 };
+		size_t                m_readDepth     = 0;
 
-	HDL_ASSERT(node->m_allocated);
-	node->m_value.~T();
-	node->m_allocated = false;
+		~ThreadData() { if (m_pool) m_pool->detachThreadData(*this); } // Flush the magazine on thread exit.
+	};
 
+	// Data of the current thread for each pool of the type it used, most recently used first.
+	struct ThreadDataList
 	{
-		LockGuard guard(m_mutex);
-		m_handleCount--;
-		m_freeIndices.push_back(index);
-	}
+		ThreadData* m_first = nullptr;
 
-	return true;
-}
+		~ThreadDataList()
+		{
+			while (m_first)
+			{
+				ThreadData* threadData = m_first;
+				m_first = threadData->m_nextInThread;
+				delete threadData;
+			}
+		}
+	};
 
-template<typename T, typename IntegerType, size_t MaxHandles>
-T* 
-HandlePool<T, IntegerType, MaxHandles>::get(integer_type _handle)
+	ThreadData& getThreadData();
+	void        detachThreadData(ThreadData& _threadData);
+
+	// Element that was destroyed while read sections were in progress, its destructor call is deferred.
+	struct DeferredDestruction
+	{
+		index_type m_index;
+		uint64_t   m_epoch;
+		int        m_replacedSlot; // Slot of the replaced element to destroy (see Policy::kReplaceable), or -1 to destroy the node.
+	};
+
+	void   destroyNodes(const index_type* _indices, size_t _count);
+	void   freeIndices(const index_type* _indices, size_t _count);
+	void   deferDestructions(const index_type* _indices, size_t _count, int _replacedSlot = -1);
+
+	// Shard of a ShardedHandlePool: limits the indices to the shard's range, uses the id of the sharded pool, and receives 
+	// the destructions of the other threads in an inbox (a lock-free stack threaded through the destroyed nodes) instead of the free list.
+	void   initShard(size_t _maxHandles, size_t _maxNodeCount, size_t _poolId);
+	bool   destroyToInbox(integer_type _handle);
+
+	size_t                  m_maxHandles;             // Runtime limit, can be lower than MaxHandles to reserve less memory.
+	size_t                  m_poolId;                 // Encoded in the handles, see Policy::kPoolIdNumBits.
+	size_t                  m_maxNodeCount;           // Number of nodes that fit in the reserved pages (and are indexable), can be more than m_maxHandles.
+	Array<Node>             m_nodes;
+	Array<NodeVersion>      m_versions;                 // Only used with Policy::kSeparateVersions.
+	Array<std::atomic<uint64_t> > m_occupancy;          // Only used with Policy::kOccupancyBitmap.
+	std::atomic<size_t>     m_nodeBufferSizeBytes     { 0 };
+	std::atomic<size_t>     m_nodeBufferCapacityBytes { 0 };
+	std::atomic<size_t>     m_handleCount             { 0 };
+	std::atomic<size_t>     m_retiredCount            { 0 };  // Only used with Policy::kRetireSaturatedNodes.
+	FreeList                m_freeIndices;
+	LockFreeStackFreeList   m_inbox;                    // Free indices pushed by other threads, only used by ShardedHandlePool (see destroyToInbox).
+	ThreadData*             m_threadDataList          = nullptr;
+	std::atomic<uint64_t>   m_epoch                   { 1 };
+	HDL_DEQUE<DeferredDestruction> m_deferredDestructions;
+	HDL_MUTEX               m_mutex;
+};
+
+template <typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+class HandlePool<T, IntegerType, MaxHandles, Policy>::ReadGuard
 {
-	if (_handle == kInvalid)
-		return nullptr;
+public:
+	explicit ReadGuard(this_type& _pool) : m_threadData(_pool.getThreadData())
+	{
+		static_assert(kDeferredDestruction, "Read sections are only available with DefaultPolicy::kDeferredDestruction.");
 
-	index_type index = GetIndex(_handle);
-	size_t version = GetVersion(_handle);
+		// Note: Everything is seq_cst here and in destroy/collect, this is what guarantees that if collect doesn't see this
+		// read section, get will see that the handles destroyed before the collect are invalid.
+		if (m_threadData.m_readDepth++ == 0)
+			m_threadData.m_readEpoch.store(_pool.m_epoch.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+	}
 
-	HDL_ASSERT(index < getNodeBufferSize());
-	auto node = m_nodeBuffer + index;
+	~ReadGuard()
+	{
+		if (--m_threadData.m_readDepth == 0)
+			m_threadData.m_readEpoch.store(0, std::memory_order_release);
+	}
 
-	if (node->m_version != version)
-		return nullptr; // The handle was already destroyed.
+	ReadGuard(const ReadGuard&) = delete;
+	ReadGuard& operator=(const ReadGuard&) = delete;
 
-	HDL_ASSERT(node->m_allocated);
-	return &node->m_value;
-}
+private:
+	ThreadData& m_threadData;
+};
 
-template<typename T, typename IntegerType, size_t MaxHandles>
-bool
-HandlePool<T, IntegerType, MaxHandles>::reserve(size_t _newCap)
+// Pins an element for its lifetime (see Policy::kRefCounting). Movable, so it can be returned.
+template <typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+class HandlePool<T, IntegerType, MaxHandles, Policy>::Pinned
 {
-	LockGuard guard(m_mutex);
-	return reserveNoLock(_newCap);
-}
+public:
+	Pinned(this_type& _pool, integer_type _handle) : m_pool(&_pool), m_handle(_handle), m_element(_pool.acquire(_handle)) {}
+	Pinned(Pinned&& _other) : m_pool(_other.m_pool), m_handle(_other.m_handle), m_element(_other.m_element) { _other.m_element = nullptr; }
 
-template<typename T, typename IntegerType, size_t MaxHandles>
-bool
-HandlePool<T, IntegerType, MaxHandles>::reserveNoLock(size_t _newCap)
-{
-	if (_newCap > max_size())
-		return false;
+	~Pinned()
+	{
+		if (m_element)
+			m_pool->release(m_handle);
+	}
 
-	auto currentCap = capacity();
+	Pinned(const Pinned&) = delete;
+	Pinned& operator=(const Pinned&) = delete;
 
-	if (_newCap <= currentCap)
-		return true; // Nothing to do, we already have enough capacity
+	T*       get() const                 { return m_element; }
+	T*       operator->() const          { return m_element; }
+	T&       operator*() const           { return *m_element; }
+	explicit operator bool() const       { return m_element != nullptr; }
 
-	// Check how many pages we need to store the additional nodes
-	size_t freeBytes = m_nodeBufferCapacityBytes - m_nodeBufferSizeBytes;
-	size_t neededBytes = (_newCap - currentCap) * sizeof(Node) - freeBytes;
-	auto pageSize = HDL::VirtualMemory::GetPageSize();
-	size_t nbPages = 1;
-	if (neededBytes > pageSize)
-		nbPages = 1 + neededBytes / pageSize;
+private:
+	this_type*   m_pool;
+	integer_type m_handle;
+	T*           m_element;
+};
 
-	// Reserve the node buffer if it wasn't done yet
-	if (!m_nodeBuffer)
-		m_nodeBuffer = (Node*)HDL::VirtualMemory::Reserve(kMaxHandles * sizeof(Node));
+// Locks an element for its lifetime (see Policy::kNodeLocks). Movable, so it can be returned.
+template <typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+class HandlePool<T, IntegerType, MaxHandles, Policy>::Locked
+{
+public:
+	Locked(this_type& _pool, integer_type _handle) : m_pool(&_pool), m_handle(_handle), m_element(_pool.lock(_handle)) {}
+	Locked(Locked&& _other) : m_pool(_other.m_pool), m_handle(_other.m_handle), m_element(_other.m_element) { _other.m_element = nullptr; }
 
-	// Increase capacity by commiting more pages
-	// Note: The memory allocated by VirtualMemory::Commit is zeroed, so m_version/m_allocated inside the nodes will automatically be initialized to 0
-	if (!HDL::VirtualMemory::Commit((char*)m_nodeBuffer + m_nodeBufferCapacityBytes, nbPages * pageSize))
+	~Locked()
 	{
-		// Allocation failed. (Out of memory?)
-		return false;
+		if (m_element)
+			m_pool->unlock(m_handle);
 	}
 
-	m_nodeBufferCapacityBytes += nbPages * pageSize;
+	Locked(const Locked&) = delete;
+	Locked& operator=(const Locked&) = delete;
 
-	return true;
-}
+	T*       get() const                 { return m_element; }
+	T*       operator->() const          { return m_element; }
+	T&       operator*() const           { return *m_element; }
+	explicit operator bool() const       { return m_element != nullptr; }
 
-template<typename T, typename IntegerType, size_t MaxHandles>
-size_t
-HandlePool<T, IntegerType, MaxHandles>::getNodeBufferSize() const
+private:
+	this_type*   m_pool;
+	integer_type m_handle;
+	T*           m_element;
+};
+
+template <typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+HandlePool<T, IntegerType, MaxHandles, Policy>::HandlePool(size_t _maxHandles, size_t _poolId)
+	: m_maxHandles(MinSizeT(_maxHandles, kMaxHandles))
+	, m_poolId(_poolId)
+{
+	HDL_ASSERT(_maxHandles <= kMaxHandles, "The handle format can't address more than MaxHandles elements.");
+	HDL_ASSERT(_poolId <= kMaxPoolId, "The pool id doesn't fit in DefaultPolicy::kPoolIdNumBits.");
+
+	// The nodes in the last reserved page (or chunk) can be used too, as long as their index fits in kIndexNumBits.
+	m_maxNodeCount = MinSizeT(Array<Node>::GetMaxCount(m_maxHandles), (size_t)1 << kIndexNumBits);
+}
+
+template <typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+HandlePool<T, IntegerType, MaxHandles, Policy>::~HandlePool()
+{
+	// Detach the data of all the threads (the free indices in their magazines are not needed anymore)
+	// Note: The pool should not be in use by other threads while it's being destroyed, so it's safe to touch their data.
+	while (m_threadDataList)
+	{
+		auto threadData = m_threadDataList;
+		m_threadDataList = threadData->m_next;
+		threadData->m_pool = nullptr;
+		threadData->m_prev = threadData->m_next = nullptr;
+		threadData->m_magazineCount = 0;
+	}
+
+	// Destroy the elements whose destruction was deferred (their nodes are not marked as allocated anymore)
+	for (auto& deferred : m_deferredDestructions)
+	{
+		if (deferred.m_replacedSlot >= 0)
+			nodeValue(deferred.m_index, (uint32_t)deferred.m_replacedSlot).~T();
+		else
+			nodeValue(deferred.m_index).~T();
+	}
+
+	// Destroy all the allocated nodes, and the destroyed ones that were still pinned
+	size_t nodeCount = getNodeBufferSize();
+	for (size_t i = 0; i < nodeCount; ++i)
+	{
+		if ((nodeVersion(i).load(std::memory_order_relaxed) & kAllocatedBit)
+			|| (kRefCounting && (nodeRefCount(i).load(std::memory_order_relaxed) & kPendingDestroyBit)))
+			nodeValue(i).~T();
+	}
+
+	// Note: The memory is released by the destructors of the arrays.
+}
+
+template <typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+template <class ... Args>
+IntegerType
+HandlePool<T, IntegerType, MaxHandles, Policy>::create(Args&&... _args)
+{
+	// Count the handle first, this is what limits the number of handles to max_size().
+	if (reserveHandleCount(1) == 0)
+		return kInvalid;
+
+	index_type index;
+
+	// With the lock-free free list or with magazines, the mutex is only needed to grow the node buffer.
+	bool allocated = false;
+	if (kMagazineSize > 0)
+		allocated = allocateIndexFromMagazine(index);
+	else if (kLockFreeFreeList)
+		allocated = allocateIndex(index);
+
+	if (!allocated)
+	{
+		LockGuard guard(m_mutex);
+
+		while (!allocateIndex(index))
+		{
+			// Last option, grow the node buffer
+			// Note: At this point, the free list can only be empty if there are less than max_size() nodes in the buffer.
+			// Increase capacity to store at least one more node.
+			if (!growNoLock())
+			{
+				// Reserve failed, probably out-of-memory.
+				m_handleCount.fetch_sub(1, std::memory_order_relaxed);
+				return kInvalid;
+			}
+		}
+
+	} // LockGuard end
+
+	return constructNode(index, std::forward<Args>(_args)...);
+}
+
+template <typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+template <typename HandleType, class ... Args>
+size_t
+HandlePool<T, IntegerType, MaxHandles, Policy>::create_n(HandleType* _outHandles, size_t _count, const Args&... _args)
+{
+	size_t numCreated = 0;
+
+	while (numCreated < _count)
+	{
+		index_type indices[kBatchSize];
+		size_t numIndices = reserveHandleCount(MinSizeT(_count - numCreated, kBatchSize));
+		if (numIndices == 0)
+			break;
+
+		{
+			LockGuard guard(m_mutex);
+			size_t numAllocated = allocateIndicesNoLock(indices, numIndices);
+			if (numAllocated < numIndices)
+			{
+				// Growing failed, probably out-of-memory.
+				m_handleCount.fetch_sub(numIndices - numAllocated, std::memory_order_relaxed);
+				numIndices = numAllocated;
+			}
+		}
+
+		for (size_t i = 0; i < numIndices; ++i)
+			_outHandles[numCreated++] = HandleType(constructNode(indices[i], _args...));
+
+		if (numIndices < kBatchSize && numCreated < _count)
+			break; // MaxHandles reached or out-of-memory.
+	}
+
+	for (size_t i = numCreated; i < _count; ++i)
+		_outHandles[i] = HandleType(kInvalid);
+
+	return numCreated;
+}
+
+template <typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+template <class ... Args>
+IntegerType
+HandlePool<T, IntegerType, MaxHandles, Policy>::constructNode(index_type _index, Args&&... _args)
+{
+	auto& version = nodeVersion(_index);
+	NodeVersionType versionValue = version.load(std::memory_order_relaxed);
+	HDL_ASSERT((versionValue & kAllocatedBit) == 0);
+
+	new (&nodeValue(_index)) T(std::forward<Args>(_args)...);
+
+	// Set the occupancy bit before publishing the node, so that it can't be cleared by destroy before being set.
+	setOccupied(_index, true);
+
+	// The reference of the creation. Not a store, pin attempts with stale handles may be in progress.
+	if (kRefCounting)
+		nodeRefCount(_index).fetch_add(1, std::memory_order_relaxed);
+
+	// Release order: get should not see the node as allocated before the element is constructed.
+	version.store((NodeVersionType)(versionValue | kAllocatedBit), std::memory_order_release);
+
+	return GetID(_index, versionValue >> 1, m_poolId);
+}
+
+template<typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+bool
+HandlePool<T, IntegerType, MaxHandles, Policy>::destroy(integer_type _handle)
+{
+	index_type index;
+	if (!invalidateHandle(_handle, index))
+		return false; // The handle was already destroyed.
+
+	// If the element is pinned, the last release destroys it.
+	if (!kRefCounting || releaseNodeRef(index, true))
+		destroyNodes(&index, 1);
+
+	return true;
+}
+
+template <typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+template <typename HandleType>
+size_t
+HandlePool<T, IntegerType, MaxHandles, Policy>::destroy_n(const HandleType* _handles, size_t _count)
+{
+	size_t numDestroyed = 0;
+
+	for (size_t begin = 0; begin < _count; begin += kBatchSize)
+	{
+		size_t end = MinSizeT(begin + kBatchSize, _count);
+
+		index_type indices[kBatchSize];
+		size_t numIndices = 0;
+		for (size_t i = begin; i < end; ++i)
+		{
+			if (!invalidateHandle(_handles[i], indices[numIndices]))
+				continue;
+
+			numDestroyed++;
+
+			// If the element is pinned, the last release destroys it.
+			if (!kRefCounting || releaseNodeRef(indices[numIndices], true))
+				numIndices++;
+		}
+
+		destroyNodes(indices, numIndices);
+	}
+
+	return numDestroyed;
+}
+
+template <typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+template <typename HandleType>
+size_t
+HandlePool<T, IntegerType, MaxHandles, Policy>::get_n(const HandleType* _handles, T** _outElements, size_t _count)
+{
+	size_t numValid = 0;
+
+	for (size_t i = 0; i < _count; ++i)
+	{
+		T* element = get(_handles[i]);
+		_outElements[i] = element;
+		numValid += element != nullptr;
+	}
+
+	return numValid;
+}
+
+template <typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+template <class ... Args>
+bool
+HandlePool<T, IntegerType, MaxHandles, Policy>::replace(integer_type _handle, Args&&... _args)
+{
+	static_assert(kReplaceable, "Replace is only available with DefaultPolicy::kReplaceable.");
+
+	for (int attempt = 0; attempt < 2; ++attempt)
+	{
+		// Inside a read section, a node destroyed concurrently can't be freed (nor its current element destroyed) before the end of it.
+		{
+			ReadGuard guard(*this);
+			if (get(_handle) == nullptr)
+				return false;
+
+			index_type index = GetIndex(_handle);
+			auto& slotState = nodeSlotState(index);
+
+			// Take the spare slot.
+			uint32_t state = slotState.load(std::memory_order_relaxed);
+			while ((state & kSpareBusyBit) == 0 
+				&& !slotState.compare_exchange_weak(state, state | kSpareBusyBit, std::memory_order_acquire, std::memory_order_relaxed))
+			{
+			}
+
+			if ((state & kSpareBusyBit) == 0)
+			{
+				uint32_t oldSlot = state & kActiveSlotBit;
+				new (&nodeValue(index, oldSlot ^ kActiveSlotBit)) T(std::forward<Args>(_args)...);
+
+				// Publish the new element, then the old one is destroyed like the element of a destroyed node, once the read sections 
+				// that could have seen it have ended. Only this thread can change the active slot until then.
+				slotState.fetch_xor(kActiveSlotBit, std::memory_order_seq_cst);
+				deferDestructions(&index, 1, (int)oldSlot);
+				return true;
+			}
+		}
+
+		// The previous replacement is still waiting for its destruction, try to end it.
+		if (attempt == 0 && collect() == 0)
+			return false;
+	}
+
+	return false;
+}
+
+template<typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+bool
+HandlePool<T, IntegerType, MaxHandles, Policy>::releaseReplacedSlot(index_type _index)
+{
+	// The spare slot is free again. If the node was destroyed meanwhile, it can be freed now.
+	uint32_t state = nodeSlotState(_index).fetch_and(kActiveSlotBit, std::memory_order_acq_rel);
+	return (state & kDestroyedBit) != 0;
+}
+
+template<typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+bool
+HandlePool<T, IntegerType, MaxHandles, Policy>::markReplaceableNodeDestroyed(index_type _index)
+{
+	// If a replaced element still waits for its destruction, its destruction frees the node (see releaseReplacedSlot).
+	auto& slotState = nodeSlotState(_index);
+	uint32_t state = slotState.fetch_or(kDestroyedBit, std::memory_order_acq_rel);
+	if (state & kSpareBusyBit)
+		return false;
+
+	slotState.fetch_and(~kDestroyedBit, std::memory_order_relaxed);
+	return true;
+}
+
+template<typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+T*
+HandlePool<T, IntegerType, MaxHandles, Policy>::lock(integer_type _handle)
+{
+	static_assert(kNodeLocks, "Node locks are only available with DefaultPolicy::kNodeLocks.");
+
+	if (_handle == kInvalid || (kPoolIdNumBits > 0 && GetPoolId(_handle) != m_poolId))
+		return nullptr;
+
+	index_type index = GetIndex(_handle);
+	size_t version = GetVersion(_handle);
+
+	assertIndexInRange(index);
+
+	// Validating the handle and taking the lock is a single compare-exchange, and destroy waits for the lock to be released,
+	// so the element can't be destroyed while it's locked.
+	auto& nodeVersionValue = nodeVersion(index);
+	const NodeVersionType expected = (NodeVersionType)((version << 1) | kAllocatedBit);
+	NodeVersionType versionValue = expected;
+	while (!nodeVersionValue.compare_exchange_weak(versionValue, (NodeVersionType)(expected | kLockBit), 
+		kDeferredDestruction ? std::memory_order_seq_cst : std::memory_order_acquire, std::memory_order_relaxed))
+	{
+		if (versionValue != expected && versionValue != (expected | kLockBit))
+			return nullptr; // The handle was already destroyed.
+
+		if (versionValue != expected)
+			std::this_thread::yield();
+		versionValue = expected;
+	}
+
+	return &nodeValue(index);
+}
+
+template<typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+void
+HandlePool<T, IntegerType, MaxHandles, Policy>::unlock(integer_type _handle)
+{
+	static_assert(kNodeLocks, "Node locks are only available with DefaultPolicy::kNodeLocks.");
+
+	// Release: the modifications done under the lock are visible to the next thread that takes it.
+	nodeVersion(GetIndex(_handle)).fetch_and((NodeVersionType)~kLockBit, std::memory_order_release);
+}
+
+template<typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+T*
+HandlePool<T, IntegerType, MaxHandles, Policy>::acquire(integer_type _handle)
+{
+	static_assert(kRefCounting, "Pins are only available with DefaultPolicy::kRefCounting.");
+
+	if (_handle == kInvalid || (kPoolIdNumBits > 0 && GetPoolId(_handle) != m_poolId))
+		return nullptr;
+
+	index_type index = GetIndex(_handle);
+	size_t version = GetVersion(_handle);
+
+	assertIndexInRange(index);
+
+	// Pin first, then check the handle: destroy invalidates the handle before dropping the reference of the creation, 
+	// so either the version check fails, or the element can't be destroyed before this pin is released.
+	// Note: seq_cst, this is a store followed by a load of another variable (same as destroy, the other way around).
+	nodeRefCount(index).fetch_add(1, std::memory_order_seq_cst);
+
+	if ((nodeVersion(index).load(std::memory_order_seq_cst) & ~kLockBit) != ((version << 1) | kAllocatedBit))
+	{
+		// Stale handle. The element may have been waiting for this temporary reference to go away.
+		if (releaseNodeRef(index, false))
+			destroyNodes(&index, 1);
+		return nullptr;
+	}
+
+	return &nodeValue(index);
+}
+
+template<typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+void
+HandlePool<T, IntegerType, MaxHandles, Policy>::release(integer_type _handle)
+{
+	static_assert(kRefCounting, "Pins are only available with DefaultPolicy::kRefCounting.");
+
+	index_type index = GetIndex(_handle);
+	if (releaseNodeRef(index, false))
+		destroyNodes(&index, 1);
+}
+
+template<typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+bool
+HandlePool<T, IntegerType, MaxHandles, Policy>::releaseNodeRef(index_type _index, bool _destroyed)
+{
+	auto& refCount = nodeRefCount(_index);
+
+	// Destroy drops the reference of the creation and marks the node as pending destruction in the same operation.
+	uint32_t delta = _destroyed ? kPendingDestroyBit - 1 : (uint32_t)-1;
+	uint32_t newValue = refCount.fetch_add(delta, std::memory_order_seq_cst) + delta;
+	if (newValue != kPendingDestroyBit)
+		return false; // Still pinned, or not destroyed.
+
+	// Last reference. Temporary references of stale handles can still come and go, only one thread gets to destroy the element.
+	uint32_t expected = kPendingDestroyBit;
+	return refCount.compare_exchange_strong(expected, 0, std::memory_order_acq_rel, std::memory_order_relaxed);
+}
+
+template<typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+void
+HandlePool<T, IntegerType, MaxHandles, Policy>::destroyNodes(const index_type* _indices, size_t _count)
+{
+	if (kDeferredDestruction)
+	{
+		deferDestructions(_indices, _count);
+		return;
+	}
+
+	for (size_t i = 0; i < _count; ++i)
+		nodeValue(_indices[i]).~T();
+
+	freeIndices(_indices, _count);
+}
+
+template<typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+bool
+HandlePool<T, IntegerType, MaxHandles, Policy>::invalidateHandle(integer_type _handle, index_type& _outIndex)
+{
+	if (_handle == kInvalid || (kPoolIdNumBits > 0 && GetPoolId(_handle) != m_poolId))
+		return false;
+
+	index_type index = GetIndex(_handle);
+	size_t version = GetVersion(_handle);
+
+	assertIndexInRange(index);
+
+	size_t nextVersion = version + 1;
+	// Force the version to wrap around to make sure it doesn't use more than VersionNumBits (otherwise the equality test would fail).
+	nextVersion &= kVersionMask;
+
+	// Special case for the last index: it cannot use the max version, otherwise the handle would be equal to kInvalid.
+	// In this case, wrap around sooner.
+	if (GetID(index, nextVersion) == kInvalid)
+		nextVersion = 0;
+
+	// Invalidate the handle first, so that concurrent get calls fail from now on. 
+	// If several threads try to destroy the same handle, only one of them wins.
+	const NodeVersionType expected = (NodeVersionType)((version << 1) | kAllocatedBit);
+	NodeVersionType versionValue = expected;
+	while (!nodeVersion(index).compare_exchange_weak(versionValue, (NodeVersionType)(nextVersion << 1), 
+		kDeferredDestruction ? std::memory_order_seq_cst : std::memory_order_acquire, std::memory_order_relaxed))
+	{
+		if (versionValue != expected && versionValue != (expected | kLockBit))
+			return false; // The handle was already destroyed.
+
+		// Locked (see lock), wait until it's unlocked.
+		if (versionValue != expected)
+			std::this_thread::yield();
+		versionValue = expected;
+	}
+
+	// Seqlock write (see try_read): the acquire of the compare-exchange doesn't keep the writes to the node that follow 
+	// (destruction, free list, next creation) after its store on weakly ordered CPUs. Pairs with the fence of try_read.
+	if (std::is_trivially_copyable<T>::value)
+		std::atomic_thread_fence(std::memory_order_release);
+
+	setOccupied(index, false);
+
+	// The node keeps its last version forever, freeIndices leaves it out of the free list.
+	if (kRetireSaturatedNodes && nextVersion == GetRetiredVersion(index))
+		m_retiredCount.fetch_add(1, std::memory_order_relaxed);
+
+	_outIndex = index;
+	return true;
+}
+
+template<typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+void
+HandlePool<T, IntegerType, MaxHandles, Policy>::freeIndices(const index_type* _indices, size_t _count)
+{
+	if (_count == 0)
+		return;
+
+	// Retired nodes are never reused (but their elements are destroyed, so they still leave the count).
+	if (kMagazineSize > 0)
+	{
+		for (size_t i = 0; i < _count; ++i)
+		{
+			if (!isRetired(_indices[i]))
+				freeIndexToMagazine(_indices[i]);
+		}
+	}
+	else if (kLockFreeFreeList)
+	{
+		for (size_t i = 0; i < _count; ++i)
+		{
+			if (!isRetired(_indices[i]))
+				m_freeIndices.push(*this, _indices[i]);
+		}
+	}
+	else
+	{
+		LockGuard guard(m_mutex);
+		for (size_t i = 0; i < _count; ++i)
+		{
+			if (!isRetired(_indices[i]))
+				m_freeIndices.push(*this, _indices[i]);
+		}
+	}
+
+	// Note: Only decrement the count once the indices are back in the free list, 
+	// so that a create call that sees the count below max_size() is guaranteed to find a free index.
+	m_handleCount.fetch_sub(_count, std::memory_order_relaxed);
+}
+
+template<typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+void
+HandlePool<T, IntegerType, MaxHandles, Policy>::deferDestructions(const index_type* _indices, size_t _count, int _replacedSlot)
+{
+	if (_count == 0)
+		return;
+
+	size_t numDeferred;
+	{
+		LockGuard guard(m_mutex);
+
+		// Incrementing the epoch means the read sections that start from now on can't see these elements.
+		uint64_t epoch = m_epoch.fetch_add(1, std::memory_order_seq_cst);
+		for (size_t i = 0; i < _count; ++i)
+			m_deferredDestructions.push_back({ _indices[i], epoch, _replacedSlot });
+		numDeferred = m_deferredDestructions.size();
+	}
+
+	// Collect every kDeferredDestructionBatch deferred destructions.
+	if ((numDeferred - _count) / kDeferredDestructionBatch != numDeferred / kDeferredDestructionBatch)
+		collect();
+}
+
+template<typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+void
+HandlePool<T, IntegerType, MaxHandles, Policy>::initShard(size_t _maxHandles, size_t _maxNodeCount, size_t _poolId)
+{
+	HDL_ASSERT(getNodeBufferSize() == 0 && _maxHandles <= _maxNodeCount, "The limits must be set before the first creation.");
+
+	m_maxHandles = MinSizeT(_maxHandles, kMaxHandles);
+	m_maxNodeCount = MinSizeT(m_maxNodeCount, _maxNodeCount);
+	m_poolId = _poolId;
+}
+
+template<typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+bool
+HandlePool<T, IntegerType, MaxHandles, Policy>::destroyToInbox(integer_type _handle)
+{
+	index_type index;
+	if (!invalidateHandle(_handle, index))
+		return false; // The handle was already destroyed.
+
+	nodeValue(index).~T();
+
+	// Same as freeIndices, but lock-free and without touching the free list. allocateIndex looks in the inbox before growing.
+	if (!isRetired(index))
+		m_inbox.push(*this, index);
+
+	m_handleCount.fetch_sub(1, std::memory_order_relaxed);
+	return true;
+}
+
+template<typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+T* 
+HandlePool<T, IntegerType, MaxHandles, Policy>::get(integer_type _handle)
+{
+	// The handles of the other pools of this type (see HDL::Pool) are rejected like invalid ones. No check without pool ids.
+	if (_handle == kInvalid || (kPoolIdNumBits > 0 && GetPoolId(_handle) != m_poolId))
+		return nullptr;
+
+	index_type index = GetIndex(_handle);
+	size_t version = GetVersion(_handle);
+
+	assertIndexInRange(index);
+
+	// Note: seq_cst is also a plain load on x86, but only needed with deferred destructions (see ReadGuard).
+	auto versionValue = nodeVersion(index).load(kDeferredDestruction ? std::memory_order_seq_cst : std::memory_order_acquire);
+	if ((versionValue & ~kLockBit) != ((version << 1) | kAllocatedBit))
+		return nullptr; // The handle was already destroyed.
+
+	return &nodeValue(index);
+}
+
+template<typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+bool
+HandlePool<T, IntegerType, MaxHandles, Policy>::try_read(integer_type _handle, T& _out) const
+{
+	static_assert(std::is_trivially_copyable<T>::value, "try_read copies elements that may be destroyed concurrently, T must be trivially copyable.");
+	static_assert(!kReplaceable, "try_read can't detect that an element was replaced during the copy, use Get in a read section instead.");
+	static_assert(!kNodeLocks, "try_read can't detect the modifications done under the node locks, use GetLocked instead.");
+
+	if (_handle == kInvalid || (kPoolIdNumBits > 0 && GetPoolId(_handle) != m_poolId))
+		return false;
+
+	index_type index = GetIndex(_handle);
+	size_t version = GetVersion(_handle);
+
+	assertIndexInRange(index);
+
+	// Seqlock read: destroy changes the version before the element is destroyed and its node reused (and create only sets 
+	// the allocated bit once the element is constructed), so if the version is the same before and after the copy, 
+	// the copy is the element of this handle and was not modified by Destroy/Create in the meantime.
+	auto& nodeVersionValue = nodeVersion(index);
+	NodeVersionType expected = (NodeVersionType)((version << 1) | kAllocatedBit);
+	if (nodeVersionValue.load(std::memory_order_acquire) != expected)
+		return false;
+
+	typename std::aligned_storage<sizeof(T), alignof(T)>::type copy;
+	CopyRacy(&copy, m_nodes[index].m_value);
+
+	// The copy must be done before the version is read again. Pairs with the release fence of invalidateHandle: if the copy saw
+	// a write done after the handle was invalidated, the version read below is the new one.
+	std::atomic_thread_fence(std::memory_order_acquire);
+	if (nodeVersionValue.load(std::memory_order_relaxed) != expected)
+		return false;
+
+	memcpy(&_out, &copy, sizeof(T));
+	return true;
+}
+
+template<typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+bool
+HandlePool<T, IntegerType, MaxHandles, Policy>::is_valid(integer_type _handle) const
+{
+	if (_handle == kInvalid || (kPoolIdNumBits > 0 && GetPoolId(_handle) != m_poolId))
+		return false;
+
+	index_type index = GetIndex(_handle);
+	size_t version = GetVersion(_handle);
+
+	assertIndexInRange(index);
+
+	return (nodeVersion(index).load(std::memory_order_relaxed) & ~kLockBit) == ((version << 1) | kAllocatedBit);
+}
+
+template<typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+bool
+HandlePool<T, IntegerType, MaxHandles, Policy>::reserve(size_t _newCap)
+{
+	LockGuard guard(m_mutex);
+	return reserveNoLock(_newCap);
+}
+
+template<typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+size_t
+HandlePool<T, IntegerType, MaxHandles, Policy>::shrink_to_fit()
+{
+	// The nodes at the end of the buffer are allocated without locking with the other modes, they could be allocated while being released.
+	static_assert(!kLockFreeFreeList && kMagazineSize == 0, "shrink_to_fit is not supported with FreeListMode::LockFreeStack or magazines.");
+	// Stale handles can be validated at any time by other threads, so their versions must not be in the released memory.
+	static_assert(kSeparateVersions, "shrink_to_fit needs DefaultPolicy::kSeparateVersions, the versions of the released nodes must stay readable.");
+	static_assert(!kRefCounting, "shrink_to_fit is not supported with pins, Acquire reads the node before validating the handle.");
+
+	// Deferred destructions keep their nodes out of the free list, run the ones that can be run.
+	if (kDeferredDestruction)
+		collect();
+
+	LockGuard guard(m_mutex);
+
+	// Find the free nodes at the end of the buffer. Nodes that are not allocated can also be waiting for their deferred destruction
+	// or be popped by create and not constructed yet, so only the nodes in the free list can be released.
+	size_t nodeCount = getNodeBufferSize();
+	size_t newNodeCount = nodeCount;
+	while (newNodeCount > 0 && (nodeVersion(newNodeCount - 1).load(std::memory_order_relaxed) & kAllocatedBit) == 0)
+		newNodeCount--;
+
+	if (newNodeCount < nodeCount)
+	{
+		size_t tailCount = nodeCount - newNodeCount;
+		uint64_t* inFreeList = new (std::nothrow) uint64_t[(tailCount + 63) / 64]();
+		if (!inFreeList)
+			return 0;
+
+		m_freeIndices.for_each(*this, [inFreeList, newNodeCount](index_type _index)
+		{
+			if (_index >= newNodeCount)
+				inFreeList[(_index - newNodeCount) / 64] |= (uint64_t)1 << ((_index - newNodeCount) % 64);
+		});
+
+		size_t tailBegin = newNodeCount;
+		newNodeCount = nodeCount;
+		while (newNodeCount > tailBegin && (inFreeList[(newNodeCount - 1 - tailBegin) / 64] >> ((newNodeCount - 1 - tailBegin) % 64) & 1))
+			newNodeCount--;
+
+		delete[] inFreeList;
+	}
+
+	if (newNodeCount == nodeCount)
+		return 0;
+
+	// Drop the free indices of the released nodes, they are at the end of the buffer again.
+	m_freeIndices.remove_from(*this, newNodeCount);
+
+	m_nodeBufferSizeBytes.store(newNodeCount * sizeof(Node), std::memory_order_relaxed);
+
+	// Only whole pages (or chunks) can be released, the free nodes in the last page stay committed.
+	size_t capacityNodes = m_nodeBufferCapacityBytes.load(std::memory_order_relaxed) / sizeof(Node);
+	size_t newCapacityNodes = MinSizeT(Array<Node>::GetMaxCount(newNodeCount), capacityNodes);
+	if (newCapacityNodes == capacityNodes)
+		return 0;
+
+	// The versions are in their own array, which is not released: the stale handles of the released nodes stay invalid,
+	// and validating them never reads the released memory.
+	m_nodeBufferCapacityBytes.store(newCapacityNodes * sizeof(Node), std::memory_order_relaxed);
+
+	return m_nodes.shrink(newCapacityNodes);
+}
+
+template<typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+void
+HandlePool<T, IntegerType, MaxHandles, Policy>::flush_magazine()
+{
+	if (kMagazineSize == 0)
+		return;
+
+	auto& threadData = getThreadData();
+
+	LockGuard guard(m_mutex);
+	for (size_t i = 0; i < threadData.m_magazineCount; ++i)
+		m_freeIndices.push(*this, threadData.m_magazine[i]);
+	threadData.m_magazineCount = 0;
+}
+
+template<typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+size_t
+HandlePool<T, IntegerType, MaxHandles, Policy>::collect()
+{
+	size_t numDestroyed = 0;
+
+	for (;;)
+	{
+		index_type indices[kDeferredDestructionBatch];
+		size_t numIndices = 0;
+		DeferredDestruction replaced[kDeferredDestructionBatch];
+		size_t numReplaced = 0;
+
+		{
+			LockGuard guard(m_mutex);
+
+			// Find the oldest read section in progress.
+			uint64_t minReadEpoch = ~(uint64_t)0;
+			for (auto threadData = m_threadDataList; threadData; threadData = threadData->m_next)
+			{
+				uint64_t readEpoch = threadData->m_readEpoch.load(std::memory_order_seq_cst);
+				if (readEpoch != 0 && readEpoch < minReadEpoch)
+					minReadEpoch = readEpoch;
+			}
+
+			// The elements destroyed before it started can't be seen by any read section anymore.
+			while (numIndices + numReplaced < kDeferredDestructionBatch 
+				&& !m_deferredDestructions.empty() 
+				&& m_deferredDestructions.front().m_epoch < minReadEpoch)
+			{
+				if (m_deferredDestructions.front().m_replacedSlot >= 0)
+					replaced[numReplaced++] = m_deferredDestructions.front();
+				else
+					indices[numIndices++] = m_deferredDestructions.front().m_index;
+				m_deferredDestructions.pop_front();
+			}
+		}
+
+		if (numIndices + numReplaced == 0)
+			return numDestroyed;
+
+		numDestroyed += numIndices + numReplaced;
+
+		// Call the destructors outside of the lock, they might destroy other handles.
+		for (size_t i = 0; i < numIndices; ++i)
+			nodeValue(indices[i]).~T();
+
+		// With replaceable elements, a node is only freed once the element it replaced is destroyed too.
+		if (kReplaceable)
+		{
+			size_t numFreed = 0;
+			for (size_t i = 0; i < numIndices; ++i)
+			{
+				if (markReplaceableNodeDestroyed(indices[i]))
+					indices[numFreed++] = indices[i];
+			}
+			numIndices = numFreed;
+
+			for (size_t i = 0; i < numReplaced; ++i)
+			{
+				nodeValue(replaced[i].m_index, (uint32_t)replaced[i].m_replacedSlot).~T();
+				if (releaseReplacedSlot(replaced[i].m_index))
+					indices[numIndices++] = replaced[i].m_index;
+			}
+		}
+
+		freeIndices(indices, numIndices);
+	}
+}
+
+template<typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+bool
+HandlePool<T, IntegerType, MaxHandles, Policy>::reserveNoLock(size_t _newCap)
+{
+	if (_newCap > max_size())
+		return false;
+
+	auto currentCap = capacity();
+
+	if (_newCap <= currentCap)
+		return true; // Nothing to do, we already have enough capacity
+
+	// Increase capacity by commiting more pages (or allocating more chunks)
+	// Note: The new memory is zeroed, so the versions of the new nodes will automatically be initialized to 0
+	if (!m_nodes.reserve(_newCap, m_maxNodeCount))
+	{
+		// Allocation failed. (Out of memory?)
+		return false;
+	}
+
+	// All the nodes that fit in the committed memory can be used.
+	size_t newCap = MinSizeT(m_nodes.capacity(), m_maxNodeCount);
+
+	// Their versions (and occupancy bits) must be committed before they are published.
+	if (kSeparateVersions && !m_versions.reserve(newCap, m_maxNodeCount))
+		return false;
+	if (kOccupancyBitmap && !m_occupancy.reserve((newCap + 63) / 64, (m_maxNodeCount + 63) / 64))
+		return false;
+
+	// Release order: the new nodes are allocated without locking in allocateIndexAtEnd, they must not be seen before the commit is done.
+	m_nodeBufferCapacityBytes.store(newCap * sizeof(Node), std::memory_order_release);
+
+	return true;
+}
+
+template<typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+void
+HandlePool<T, IntegerType, MaxHandles, Policy>::setOccupied(size_t _index, bool _occupied)
+{
+	if (!kOccupancyBitmap)
+		return;
+
+	auto& word = m_occupancy[_index / 64];
+	uint64_t bit = (uint64_t)1 << (_index % 64);
+	if (_occupied)
+		word.fetch_or(bit, std::memory_order_relaxed);
+	else
+		word.fetch_and(~bit, std::memory_order_relaxed);
+}
+
+template<typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+template <typename Func>
+void
+HandlePool<T, IntegerType, MaxHandles, Policy>::for_each(Func _func)
+{
+	forEachInRange(0, getNodeBufferSize(), _func);
+}
+
+template<typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+template <typename Func, typename Executor>
+void
+HandlePool<T, IntegerType, MaxHandles, Policy>::parallel_for_each(Func _func, Executor& _executor)
+{
+	struct Context
+	{
+		this_type* m_pool;
+		Func*      m_func;
+		size_t     m_nodeCount;
+		size_t     m_chunkBytes;
+	};
+
+	// Chunks are made of whole pages (or storage chunks). Each node belongs to the chunk where it starts.
+	auto pageSize = Array<Node>::GetGranularity();
+	size_t chunkBytes = (HDL::kParallelChunkMinBytes + pageSize - 1) / pageSize * pageSize;
+	size_t nodeCount = getNodeBufferSize();
+	Context context = { this, &_func, nodeCount, chunkBytes };
+
+	HDL::ParallelTask task;
+	task.m_context = &context;
+	task.m_function = [](const void* _context, size_t _taskIndex)
+	{
+		auto& context = *(const Context*)_context;
+		size_t begin = MinSizeT((_taskIndex * context.m_chunkBytes + sizeof(Node) - 1) / sizeof(Node), context.m_nodeCount);
+		size_t end   = MinSizeT(((_taskIndex + 1) * context.m_chunkBytes + sizeof(Node) - 1) / sizeof(Node), context.m_nodeCount);
+		context.m_pool->forEachInRange(begin, end, *context.m_func);
+	};
+
+	size_t numChunks = (nodeCount * sizeof(Node) + chunkBytes - 1) / chunkBytes;
+	if (numChunks > 0)
+		_executor(numChunks, task);
+}
+
+template<typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+template <typename Func>
+void
+HandlePool<T, IntegerType, MaxHandles, Policy>::forEachInRange(size_t _begin, size_t _end, Func& _func)
+{
+	if (kOccupancyBitmap)
+	{
+		// Only look at the allocated nodes, 64 at a time.
+		for (size_t wordIndex = _begin / 64, wordEnd = (_end + 63) / 64; wordIndex < wordEnd; ++wordIndex)
+		{
+			uint64_t bits = m_occupancy[wordIndex].load(std::memory_order_relaxed);
+
+			// Ignore the nodes outside of the range in the first/last words.
+			if (wordIndex == _begin / 64)
+				bits &= ~(uint64_t)0 << (_begin % 64);
+			if (wordIndex == (_end - 1) / 64 && _end % 64 != 0)
+				bits &= ~(~(uint64_t)0 << (_end % 64));
+
+			while (bits)
+			{
+				size_t index = wordIndex * 64 + HDL::CountTrailingZeros(bits);
+				bits &= bits - 1;
+
+				// The bit is only a hint, the version says if the element is really there (same as get).
+				if (nodeVersion(index).load(std::memory_order_acquire) & kAllocatedBit)
+					_func(nodeValue(index));
+			}
+		}
+	}
+	else
+	{
+		for (size_t index = _begin; index < _end; ++index)
+		{
+			if (nodeVersion(index).load(std::memory_order_acquire) & kAllocatedBit)
+				_func(nodeValue(index));
+		}
+	}
+}
+
+template<typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+bool
+HandlePool<T, IntegerType, MaxHandles, Policy>::growNoLock(size_t _minNumNodes)
+{
+	auto pageSize = Array<Node>::GetGranularity();
+	size_t capacityBytes = m_nodeBufferCapacityBytes.load(std::memory_order_relaxed);
+	size_t growBytes = Policy::Growth::GetGrowSizeBytes(capacityBytes, pageSize);
+
+	// Grow by at least _minNumNodes nodes (or up to max_size()), but not above max_size().
+	size_t minCap = MinSizeT(capacity() + _minNumNodes, m_maxHandles);
+	if (minCap <= capacity())
+		return false; // Already at max_size().
+
+	size_t newCap = MinSizeT((capacityBytes + growBytes) / sizeof(Node), m_maxHandles);
+	if (newCap < minCap)
+		newCap = minCap;
+
+	if (reserveNoLock(newCap))
+		return true;
+
+	// Committing the whole step failed, try again with the bare minimum.
+	return newCap != minCap && reserveNoLock(minCap);
+}
+
+template<typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+bool
+HandlePool<T, IntegerType, MaxHandles, Policy>::allocateIndex(index_type& _outIndex)
+{
+	// Reuse the most recently freed nodes while they are still in cache, or fill the holes in the fullest pages before using new pages.
+	// The indices destroyed by other threads (see destroyToInbox) are only used before growing, it's only one load if there are none.
+	if (kLifoFreeList || kPageAwareFreeList)
+		return m_freeIndices.pop(*this, _outIndex) || allocateIndexAtEnd(_outIndex) || m_inbox.pop(*this, _outIndex);
+
+	// Use the rest of the buffer before looking for free indices to delay the wrapping of the versions as much as possible
+	return allocateIndexAtEnd(_outIndex) || m_freeIndices.pop(*this, _outIndex) || m_inbox.pop(*this, _outIndex);
+}
+
+template<typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+size_t
+HandlePool<T, IntegerType, MaxHandles, Policy>::allocateIndicesNoLock(index_type* _outIndices, size_t _count)
+{
+	size_t numAllocated = 0;
+
+	while (numAllocated < _count)
+	{
+		if (allocateIndex(_outIndices[numAllocated]))
+			numAllocated++;
+		else if (!growNoLock(_count - numAllocated)) // Grow once for all the missing indices.
+			break;
+	}
+
+	return numAllocated;
+}
+
+template<typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+size_t
+HandlePool<T, IntegerType, MaxHandles, Policy>::reserveHandleCount(size_t _count)
+{
+	for (;;)
+	{
+		size_t oldCount = m_handleCount.fetch_add(_count, std::memory_order_relaxed);
+		size_t numReserved = oldCount >= m_maxHandles ? 0 : MinSizeT(_count, m_maxHandles - oldCount);
+		if (numReserved < _count)
+			m_handleCount.fetch_sub(_count - numReserved, std::memory_order_relaxed);
+
+		if (numReserved > 0)
+			return numReserved;
+
+		// Some of the handles may be waiting for their deferred destruction, try to make room.
+		if (!kDeferredDestruction || collect() == 0)
+			return 0;
+	}
+}
+
+template<typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+bool
+HandlePool<T, IntegerType, MaxHandles, Policy>::allocateIndexAtEnd(index_type& _outIndex)
+{
+	// If there is enough space in the node buffer, add a node
+	// Note: This doesn't need the lock, the compare-exchange is enough to guarantee that only one thread gets each new index.
+	size_t sizeBytes = m_nodeBufferSizeBytes.load(std::memory_order_relaxed);
+	for (;;)
+	{
+		if (sizeBytes >= m_maxNodeCount * sizeof(Node)
+			|| (sizeBytes + sizeof(Node)) > m_nodeBufferCapacityBytes.load(std::memory_order_acquire))
+			return false;
+
+		if (m_nodeBufferSizeBytes.compare_exchange_weak(sizeBytes, sizeBytes + sizeof(Node), std::memory_order_relaxed))
+		{
+			_outIndex = (index_type)(sizeBytes / sizeof(Node));
+			return true;
+		}
+	}
+}
+
+template<typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+bool
+HandlePool<T, IntegerType, MaxHandles, Policy>::allocateIndexFromMagazine(index_type& _outIndex)
+{
+	auto& threadData = getThreadData();
+
+	if (threadData.m_magazineCount == 0)
+	{
+		// New nodes at the end of the buffer don't need the lock, use them first.
+		if (allocateIndexAtEnd(_outIndex))
+			return true;
+
+		// Otherwise refill the magazine with a batch of free indices.
+		LockGuard guard(m_mutex);
+
+		index_type index;
+		while (threadData.m_magazineCount < kMagazineBatchSize && m_freeIndices.pop(*this, index))
+			threadData.m_magazine[threadData.m_magazineCount++] = index;
+
+		if (threadData.m_magazineCount == 0)
+			return false; // No free index, the node buffer needs to grow.
+	}
+
+	_outIndex = threadData.m_magazine[--threadData.m_magazineCount];
+	return true;
+}
+
+template<typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+void
+HandlePool<T, IntegerType, MaxHandles, Policy>::freeIndexToMagazine(index_type _index)
+{
+	auto& threadData = getThreadData();
+
+	if (threadData.m_magazineCount == kMagazineSize)
+	{
+		// The magazine is full, give a batch of indices back to the pool.
+		// Give the oldest ones, the most recently freed nodes are more likely to still be in cache.
+		{
+			LockGuard guard(m_mutex);
+			for (size_t i = 0; i < kMagazineBatchSize; ++i)
+				m_freeIndices.push(*this, threadData.m_magazine[i]);
+		}
+
+		threadData.m_magazineCount -= kMagazineBatchSize;
+		for (size_t i = 0; i < threadData.m_magazineCount; ++i)
+			threadData.m_magazine[i] = threadData.m_magazine[i + kMagazineBatchSize];
+	}
+
+	threadData.m_magazine[threadData.m_magazineCount++] = _index;
+}
+
+template<typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+typename HandlePool<T, IntegerType, MaxHandles, Policy>::ThreadData&
+HandlePool<T, IntegerType, MaxHandles, Policy>::getThreadData()
+{
+	static thread_local ThreadDataList s_threadDataList;
+
+	// Fast path: this pool was the last one used by the thread.
+	ThreadData* threadData = s_threadDataList.m_first;
+	if (threadData && threadData->m_pool == this)
+		return *threadData;
+
+	// Look for the data of this pool, and remember a detached one to reuse (its pool was destroyed).
+	ThreadData** link = &s_threadDataList.m_first;
+	ThreadData** detachedLink = nullptr;
+	while (*link && (*link)->m_pool != this)
+	{
+		if ((*link)->m_pool == nullptr && (*link)->m_readDepth == 0 && detachedLink == nullptr)
+			detachedLink = link;
+		link = &(*link)->m_nextInThread;
+	}
+
+	if (*link == nullptr && detachedLink != nullptr)
+		link = detachedLink;
+
+	if (*link != nullptr)
+	{
+		threadData = *link;
+		*link = threadData->m_nextInThread;
+	}
+	else
+	{
+		threadData = new ThreadData;
+	}
+
+	// Move it to the front of the list.
+	threadData->m_nextInThread = s_threadDataList.m_first;
+	s_threadDataList.m_first = threadData;
+
+	if (threadData->m_pool != this)
+	{
+		LockGuard guard(m_mutex);
+		threadData->m_pool = this;
+		threadData->m_next = m_threadDataList;
+		if (m_threadDataList)
+			m_threadDataList->m_prev = threadData;
+		m_threadDataList = threadData;
+	}
+
+	return *threadData;
+}
+
+template<typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+void
+HandlePool<T, IntegerType, MaxHandles, Policy>::detachThreadData(ThreadData& _threadData)
+{
+	LockGuard guard(m_mutex);
+
+	for (size_t i = 0; i < _threadData.m_magazineCount; ++i)
+		m_freeIndices.push(*this, _threadData.m_magazine[i]);
+	_threadData.m_magazineCount = 0;
+
+	if (_threadData.m_prev)
+		_threadData.m_prev->m_next = _threadData.m_next;
+	else
+		m_threadDataList = _threadData.m_next;
+	if (_threadData.m_next)
+		_threadData.m_next->m_prev = _threadData.m_prev;
+
+	_threadData.m_pool = nullptr;
+	_threadData.m_prev = _threadData.m_next = nullptr;
+}
+
+template<typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+size_t
+HandlePool<T, IntegerType, MaxHandles, Policy>::getNodeBufferSize() const
+{
+	return m_nodeBufferSizeBytes.load(std::memory_order_relaxed) / sizeof(Node);
+}
+
+template<typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+void
+HandlePool<T, IntegerType, MaxHandles, Policy>::assertIndexInRange(index_type _index) const
+{
+	// Checks the array that is read to validate the handle. The separate versions are never released (see shrink_to_fit) and only grow,
+	// so their capacity can be read without the lock: it's at least the one at the time the handle was created.
+	HDL_ASSERT(_index < (kSeparateVersions ? m_versions.capacity() : getNodeBufferSize()));
+	(void)_index;
+}
+
+template<typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+typename HandlePool<T, IntegerType, MaxHandles, Policy>::index_type
+HandlePool<T, IntegerType, MaxHandles, Policy>::GetIndex(integer_type _handle)
+{
+	// The index is in the low bits of the handle.
+	return _handle & kIndexMask;
+}
+
+template<typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+size_t 
+HandlePool<T, IntegerType, MaxHandles, Policy>::GetVersion(integer_type _handle)
+{
+	// The version is in the high bits of the handle.
+	// Note: integer_type must be unsigned otherwise this would do an arithmetic shift instead of logical shift.
+	return (_handle >> kIndexNumBits) & kVersionMask;
+}
+
+template<typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+size_t
+HandlePool<T, IntegerType, MaxHandles, Policy>::GetPoolId(integer_type _handle)
+{
+	// The pool id is in the highest bits (see Policy::kPoolIdNumBits). Not shifted by the width of integer_type when there is none.
+	return (size_t)(_handle >> (kPoolIdNumBits > 0 ? kPoolIdShift : 0)) & kPoolIdMask;
+}
+
+template<typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+typename HandlePool<T, IntegerType, MaxHandles, Policy>::integer_type
+HandlePool<T, IntegerType, MaxHandles, Policy>::GetID(index_type _index, size_t _version)
+{
+	return (integer_type)((_version << kIndexNumBits) + _index);
+}
+
+template<typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+typename HandlePool<T, IntegerType, MaxHandles, Policy>::integer_type
+HandlePool<T, IntegerType, MaxHandles, Policy>::GetID(index_type _index, size_t _version, size_t _poolId)
+{
+	return (integer_type)(GetID(_index, _version) | ((integer_type)_poolId << (kPoolIdNumBits > 0 ? kPoolIdShift : 0)));
+}
+// Pool storing the elements contiguously (slot map), used by Handle with DefaultPolicy::kDenseStorage.
+// The handles have the same layout as with HandlePool, but their index points to a sparse node that contains the version 
+// and the position of the element in the dense array of elements. Destroying an element moves the last element in its place,
+// so the elements are always packed, in [data(), data() + size()).
+// Create/Destroy lock the mutex, Get doesn't but must not be called concurrently with Destroy (since Destroy moves elements).
+// The elements are constructed and destroyed outside of the lock (so their constructor and destructor can create and destroy
+// other elements), only the moves of the elements happen with the mutex locked.
+template <typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+class DenseHandlePool
+{
+public:
+	typedef DenseHandlePool<T, IntegerType, MaxHandles, Policy> this_type;
+	typedef HandlePool<T, IntegerType, MaxHandles, Policy>      handle_pool_type; // Only used for its handle layout (index/version bits).
+	typedef IntegerType                                         integer_type;
+	typedef typename handle_pool_type::index_type               index_type;
+	static constexpr integer_type kInvalid = handle_pool_type::kInvalid;
+
+	DenseHandlePool() = default;
+	explicit DenseHandlePool(size_t _maxHandles, size_t _poolId = 0) : m_maxHandles(handle_pool_type::MinSizeT(_maxHandles, kMaxHandles)), m_poolId(_poolId)
+	{
+		HDL_ASSERT(_maxHandles <= kMaxHandles, "The handle format can't address more than MaxHandles elements.");
+		HDL_ASSERT(_poolId <= handle_pool_type::kMaxPoolId, "The pool id doesn't fit in DefaultPolicy::kPoolIdNumBits.");
+	}
+	~DenseHandlePool();
+
+	DenseHandlePool(const this_type&) = delete;
+	this_type& operator= (this_type&) = delete;
+
+	template <class ... Args>
+	integer_type create  (Args&&... _args);
+	bool         destroy (integer_type _handle);
+	T*           get     (integer_type _handle);
+	bool         is_valid(integer_type _handle) const;
+
+	// Batch versions, they only lock the mutex twice per batch of elements (see BatchSize).
+	template <typename HandleType, class ... Args>
+	size_t       create_n (HandleType* _outHandles, size_t _count, const Args&... _args);
+	template <typename HandleType>
+	size_t       destroy_n(const HandleType* _handles, size_t _count);
+	template <typename HandleType>
+	size_t       get_n    (const HandleType* _handles, T** _outElements, size_t _count);
+
+	size_t       size    () const { return m_size.load(std::memory_order_relaxed); }
+	size_t       capacity() const { return m_capacity.load(std::memory_order_relaxed); }
+	size_t       max_size() const { return m_maxHandles; }
+	size_t       retired_count() const { return 0; }
+
+	bool         reserve (size_t _newCap);
+	size_t       shrink_to_fit();
+
+	template <typename Func>
+	void         for_each(Func _func)                { for (size_t i = 0, count = size(); i < count; ++i) _func(m_values[i]); }
+	template <typename Func, typename Executor>
+	void         parallel_for_each(Func _func, Executor& _executor);
+
+	T*           data    ()                          { return m_values.data(); }
+	integer_type get_handle(size_t _denseIndex) const;
+
+	static const size_t kMaxHandles     = handle_pool_type::kMaxHandles;
+	static const size_t kVersionMask    = handle_pool_type::kVersionMask;
+	static const size_t kPoolIdNumBits  = handle_pool_type::kPoolIdNumBits;
+	static const size_t kMaxPoolId      = handle_pool_type::kMaxPoolId;
+
+	static index_type   GetIndex  (integer_type _handle)             { return handle_pool_type::GetIndex(_handle); }
+	static size_t       GetVersion(integer_type _handle)             { return handle_pool_type::GetVersion(_handle); }
+	static size_t       GetPoolId (integer_type _handle)             { return handle_pool_type::GetPoolId(_handle); }
+	static integer_type GetID     (index_type _index, size_t _version) { return handle_pool_type::GetID(_index, _version); }
+
+	static_assert(Policy::kFreeListMode == HDL::FreeListMode::LockedFifo, "DenseHandlePool only supports FreeListMode::LockedFifo.");
+	static_assert(Policy::kMagazineSize == 0, "DenseHandlePool doesn't support magazines.");
+	static_assert(!Policy::kDeferredDestruction, "DenseHandlePool doesn't support deferred destruction.");
+	static_assert(!Policy::kSeparateVersions, "DenseHandlePool always stores the versions separately from the elements.");
+	static_assert(!Policy::kChunkedStorage, "DenseHandlePool needs the elements to be contiguous, chunked storage is not supported.");
+	static_assert(!Policy::kRetireSaturatedNodes, "DenseHandlePool doesn't support retiring nodes.");
+	static_assert(!Policy::kRefCounting, "DenseHandlePool moves the elements, they can't be pinned.");
+	static_assert(!Policy::kReplaceable, "DenseHandlePool doesn't support replacing elements.");
+	static_assert(!Policy::kNodeLocks, "DenseHandlePool moves the elements, they can't be locked.");
+	static_assert(Policy::kShardCount <= 1, "DenseHandlePool can't be sharded.");
+
+private:
+	typedef typename handle_pool_type::LockGuard LockGuard;
+
+	template <typename U>
+	using Array = HDL::VirtualMemoryArray<U, Policy::kHugePages>;
+
+	static const size_t kAllocatedBit = 1;
+
+	// Storage for the elements constructed or destroyed outside of the lock, kBatchSize of them on the stack in the batch functions.
+	// Note: Not at class scope, T can be incomplete when the pool type is instantiated.
+	template <typename U> using Storage = typename std::aligned_storage<sizeof(U), alignof(U)>::type;
+	template <typename U> static constexpr size_t BatchSize() { return sizeof(U) < 4096 ? 4096 / sizeof(U) : 1; }
+
+	struct SparseNode
+	{
+		integer_type m_version;    // (version << 1) | allocated, always fits in integer_type since the index uses at least one bit.
+		index_type   m_denseIndex; // Position of the element in m_values (only meaningful while allocated).
+	};
+
+	bool   reserveNoLock(size_t _newCap);
+	bool   growNoLock();
+	bool   allocateIndexNoLock(index_type& _outIndex);
+	bool   getSparseNode(integer_type _handle, index_type& _outIndex) const;
+	bool   reserveIndexNoLock(index_type& _outIndex);
+	integer_type insertNoLock(index_type _index, T& _value);
+	bool   removeNoLock(integer_type _handle, T* _outValue);
+
+	size_t                m_maxHandles             = kMaxHandles; // Runtime limit, see HandlePool::m_maxHandles.
+	size_t                m_poolId                 = 0;       // See HandlePool::m_poolId.
+	Array<T>              m_values;                           // Dense array of elements.
+	Array<index_type>     m_denseToSparse;                    // Sparse index of each element of m_values.
+	Array<SparseNode>     m_sparseNodes;                      // Indexed by the handle index.
+	std::atomic<size_t>   m_sparseNodeCount        { 0 };     // Number of sparse nodes used so far (allocated or in the free list).
+	std::atomic<size_t>   m_size                   { 0 };
+	std::atomic<size_t>   m_capacity               { 0 };
+	size_t                m_pendingCount           = 0;       // Indices reserved by the creations whose element is being constructed.
+	HDL_DEQUE<index_type> m_freeIndices;
+	HDL_MUTEX             m_mutex;
+};
+
+template <typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+DenseHandlePool<T, IntegerType, MaxHandles, Policy>::~DenseHandlePool()
+{
+	size_t count = size();
+	for (size_t i = 0; i < count; ++i)
+		m_values[i].~T();
+}
+
+template <typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+template <class ... Args>
+IntegerType
+DenseHandlePool<T, IntegerType, MaxHandles, Policy>::create(Args&&... _args)
+{
+	index_type index;
+	{
+		LockGuard guard(m_mutex);
+		if (!reserveIndexNoLock(index))
+			return kInvalid; // MaxHandles reached or out-of-memory.
+	}
+
+	// Construct the element outside of the lock, then move it in place (the moved-from value is destroyed after unlocking).
+	T value(std::forward<Args>(_args)...);
+
+	LockGuard guard(m_mutex);
+	return insertNoLock(index, value);
+}
+
+template <typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+template <typename HandleType, class ... Args>
+size_t
+DenseHandlePool<T, IntegerType, MaxHandles, Policy>::create_n(HandleType* _outHandles, size_t _count, const Args&... _args)
+{
+	size_t numCreated = 0;
+
+	while (numCreated < _count)
+	{
+		const size_t kBatchSize = BatchSize<T>();
+		index_type indices[kBatchSize];
+		size_t numReserved = 0;
+		size_t batchCount = handle_pool_type::MinSizeT(_count - numCreated, kBatchSize);
+		{
+			LockGuard guard(m_mutex);
+			while (numReserved < batchCount && reserveIndexNoLock(indices[numReserved]))
+				++numReserved;
+		}
+
+		// Same as create: construct outside of the lock, move in place, destroy the moved-from values outside of the lock.
+		Storage<T> values[kBatchSize];
+		for (size_t i = 0; i < numReserved; ++i)
+			new (&values[i]) T(_args...);
+
+		{
+			LockGuard guard(m_mutex);
+			for (size_t i = 0; i < numReserved; ++i)
+				_outHandles[numCreated + i] = HandleType(insertNoLock(indices[i], *(T*)&values[i]));
+		}
+
+		for (size_t i = 0; i < numReserved; ++i)
+			((T*)&values[i])->~T();
+
+		numCreated += numReserved;
+		if (numReserved < batchCount)
+			break; // MaxHandles reached or out-of-memory.
+	}
+
+	for (size_t i = numCreated; i < _count; ++i)
+		_outHandles[i] = HandleType(kInvalid);
+
+	return numCreated;
+}
+
+template <typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+bool
+DenseHandlePool<T, IntegerType, MaxHandles, Policy>::reserveIndexNoLock(index_type& _outIndex)
 {
-	return m_nodeBufferSizeBytes / sizeof(Node);
+	// The dense arrays can be smaller than the sparse nodes after shrink_to_fit.
+	if (size() + m_pendingCount == capacity() && !growNoLock())
+		return false;
+
+	if (!allocateIndexNoLock(_outIndex))
+		return false;
+
+	// The node is not marked as allocated yet, the handle stays invalid until insertNoLock.
+	++m_pendingCount;
+	return true;
 }
 
-template<typename T, typename IntegerType, size_t MaxHandles>
-typename HandlePool<T, IntegerType, MaxHandles>::index_type
-HandlePool<T, IntegerType, MaxHandles>::GetIndex(integer_type _handle)
+template <typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+IntegerType
+DenseHandlePool<T, IntegerType, MaxHandles, Policy>::insertNoLock(index_type _index, T& _value)
 {
-	// The index is in the low bits of the handle.
-	return _handle & kIndexMask;
+	HDL_ASSERT(m_pendingCount > 0);
+	--m_pendingCount;
+
+	// The new element goes at the end of the dense array.
+	size_t denseIndex = size();
+	new (&m_values[denseIndex]) T(std::move(_value));
+	m_denseToSparse[denseIndex] = _index;
+
+	auto& node = m_sparseNodes[_index];
+	node.m_denseIndex = (index_type)denseIndex;
+	node.m_version |= kAllocatedBit;
+
+	m_size.store(denseIndex + 1, std::memory_order_relaxed);
+
+	return handle_pool_type::GetID(_index, node.m_version >> 1, m_poolId);
 }
 
-template<typename T, typename IntegerType, size_t MaxHandles>
-size_t 
-HandlePool<T, IntegerType, MaxHandles>::GetVersion(integer_type _handle)
+template <typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+bool
+DenseHandlePool<T, IntegerType, MaxHandles, Policy>::destroy(integer_type _handle)
 {
-	// The version is in the high bits of the handle.
-	// Note: integer_type must be unsigned otherwise this would do an arithmetic shift instead of logical shift.
-	return _handle >> kIndexNumBits;
+	// Move the element out with the lock, destroy it without (its destructor can use the pool).
+	Storage<T> value;
+	{
+		LockGuard guard(m_mutex);
+		if (!removeNoLock(_handle, (T*)&value))
+			return false; // The handle was already destroyed.
+	}
+
+	((T*)&value)->~T();
+	return true;
 }
 
-template<typename T, typename IntegerType, size_t MaxHandles>
-typename HandlePool<T, IntegerType, MaxHandles>::integer_type
-HandlePool<T, IntegerType, MaxHandles>::GetID(index_type _index, size_t _version)
+template <typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+template <typename HandleType>
+size_t
+DenseHandlePool<T, IntegerType, MaxHandles, Policy>::destroy_n(const HandleType* _handles, size_t _count)
 {
-	return (integer_type)((_version << kIndexNumBits) + _index);
-}
\ No newline at end of file
+	size_t numDestroyed = 0;
+
+	const size_t kBatchSize = BatchSize<T>();
+	for (size_t first = 0; first < _count; first += kBatchSize)
+	{
+		Storage<T> values[kBatchSize];
+		size_t numRemoved = 0;
+		size_t batchEnd = handle_pool_type::MinSizeT(first + kBatchSize, _count);
+		{
+			LockGuard guard(m_mutex);
+			for (size_t i = first; i < batchEnd; ++i)
+				numRemoved += removeNoLock(_handles[i], (T*)&values[numRemoved]);
+		}
+
+		for (size_t i = 0; i < numRemoved; ++i)
+			((T*)&values[i])->~T();
+
+		numDestroyed += numRemoved;
+	}
+
+	return numDestroyed;
+}
+
+template <typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+bool
+DenseHandlePool<T, IntegerType, MaxHandles, Policy>::removeNoLock(integer_type _handle, T* _outValue)
+{
+	index_type index;
+	if (!getSparseNode(_handle, index))
+		return false; // The handle was already destroyed.
+
+	auto& node = m_sparseNodes[index];
+	size_t denseIndex = node.m_denseIndex;
+	size_t lastDenseIndex = size() - 1;
+
+	// Swap and pop: move the last element in place of the removed one to keep the elements packed.
+	new (_outValue) T(std::move(m_values[denseIndex]));
+	m_values[denseIndex].~T();
+	if (denseIndex != lastDenseIndex)
+	{
+		new (&m_values[denseIndex]) T(std::move(m_values[lastDenseIndex]));
+		m_values[lastDenseIndex].~T();
+
+		index_type movedIndex = m_denseToSparse[lastDenseIndex];
+		m_denseToSparse[denseIndex] = movedIndex;
+		m_sparseNodes[movedIndex].m_denseIndex = (index_type)denseIndex;
+	}
+
+	m_size.store(lastDenseIndex, std::memory_order_relaxed);
+
+	// Same version wrapping rules as HandlePool::destroy.
+	size_t nextVersion = ((node.m_version >> 1) + 1) & kVersionMask;
+	if (GetID(index, nextVersion) == kInvalid)
+		nextVersion = 0;
+	node.m_version = (integer_type)(nextVersion << 1);
+
+	m_freeIndices.push_back(index);
+
+	return true;
+}
+
+template <typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+T*
+DenseHandlePool<T, IntegerType, MaxHandles, Policy>::get(integer_type _handle)
+{
+	index_type index;
+	if (!getSparseNode(_handle, index))
+		return nullptr;
+
+	return &m_values[m_sparseNodes[index].m_denseIndex];
+}
+
+template <typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+bool
+DenseHandlePool<T, IntegerType, MaxHandles, Policy>::is_valid(integer_type _handle) const
+{
+	index_type index;
+	return getSparseNode(_handle, index);
+}
+
+template <typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+template <typename HandleType>
+size_t
+DenseHandlePool<T, IntegerType, MaxHandles, Policy>::get_n(const HandleType* _handles, T** _outElements, size_t _count)
+{
+	size_t numValid = 0;
+
+	for (size_t i = 0; i < _count; ++i)
+	{
+		T* element = get(_handles[i]);
+		_outElements[i] = element;
+		numValid += element != nullptr;
+	}
+
+	return numValid;
+}
+
+template <typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+bool
+DenseHandlePool<T, IntegerType, MaxHandles, Policy>::getSparseNode(integer_type _handle, index_type& _outIndex) const
+{
+	if (_handle == kInvalid || (kPoolIdNumBits > 0 && GetPoolId(_handle) != m_poolId))
+		return false; // Also rejects the handles of the other pools of this type (see HDL::Pool).
+
+	index_type index = GetIndex(_handle);
+	size_t version = GetVersion(_handle);
+
+	// Only written with the lock, but a handle given to the wrong pool can point past the sparse nodes.
+	if (index >= m_sparseNodeCount.load(std::memory_order_relaxed))
+		return false;
+
+	if (m_sparseNodes[index].m_version != ((version << 1) | kAllocatedBit))
+		return false;
+
+	_outIndex = index;
+	return true;
+}
+
+template <typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+typename DenseHandlePool<T, IntegerType, MaxHandles, Policy>::integer_type
+DenseHandlePool<T, IntegerType, MaxHandles, Policy>::get_handle(size_t _denseIndex) const
+{
+	HDL_ASSERT(_denseIndex < size());
+
+	index_type index = m_denseToSparse[_denseIndex];
+	return handle_pool_type::GetID(index, m_sparseNodes[index].m_version >> 1, m_poolId);
+}
+
+template <typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+bool
+DenseHandlePool<T, IntegerType, MaxHandles, Policy>::reserve(size_t _newCap)
+{
+	LockGuard guard(m_mutex);
+	return reserveNoLock(_newCap);
+}
+
+template <typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+size_t
+DenseHandlePool<T, IntegerType, MaxHandles, Policy>::shrink_to_fit()
+{
+	LockGuard guard(m_mutex);
+
+	// Only the dense arrays shrink, the sparse nodes hold the versions of the handles. Keep room for the pending creations.
+	size_t count = size() + m_pendingCount;
+	size_t releasedBytes = m_values.shrink(count) + m_denseToSparse.shrink(count);
+
+	size_t newCap = m_values.capacity();
+	newCap = handle_pool_type::MinSizeT(newCap, m_denseToSparse.capacity());
+	newCap = handle_pool_type::MinSizeT(newCap, m_sparseNodes.capacity());
+	m_capacity.store(handle_pool_type::MinSizeT(newCap, m_maxHandles), std::memory_order_relaxed);
+
+	return releasedBytes;
+}
+
+template <typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+bool
+DenseHandlePool<T, IntegerType, MaxHandles, Policy>::allocateIndexNoLock(index_type& _outIndex)
+{
+	for (;;)
+	{
+		// Use the rest of the sparse nodes before the free ones, to delay the wrapping of the versions as much as possible (same as HandlePool).
+		size_t sparseNodeCount = m_sparseNodeCount.load(std::memory_order_relaxed);
+		if (sparseNodeCount < capacity())
+		{
+			_outIndex = (index_type)sparseNodeCount;
+			m_sparseNodeCount.store(sparseNodeCount + 1, std::memory_order_relaxed);
+			return true;
+		}
+
+		if (!m_freeIndices.empty())
+		{
+			_outIndex = m_freeIndices.front();
+			m_freeIndices.pop_front();
+			return true;
+		}
+
+		if (!growNoLock())
+			return false;
+	}
+}
+
+template <typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+bool
+DenseHandlePool<T, IntegerType, MaxHandles, Policy>::growNoLock()
+{
+	size_t currentCap = capacity();
+	if (currentCap >= m_maxHandles)
+		return false;
+
+	// The growth policy applies to the array of elements, the other arrays follow.
+	size_t valuesBytes = m_values.capacity() * sizeof(T);
+	size_t growBytes = Policy::Growth::GetGrowSizeBytes(valuesBytes, Array<T>::GetGranularity());
+	size_t newCap = handle_pool_type::MinSizeT((valuesBytes + growBytes) / sizeof(T), m_maxHandles);
+	if (newCap <= currentCap)
+		newCap = currentCap + 1;
+
+	return reserveNoLock(newCap) || (newCap != currentCap + 1 && reserveNoLock(currentCap + 1));
+}
+
+template <typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+bool
+DenseHandlePool<T, IntegerType, MaxHandles, Policy>::reserveNoLock(size_t _newCap)
+{
+	if (_newCap > max_size())
+		return false;
+
+	if (_newCap <= capacity())
+		return true; // Nothing to do, we already have enough capacity
+
+	// Note: The committed memory is zeroed, so the versions of the sparse nodes are initialized to 0.
+	if (!m_values.reserve(_newCap, m_maxHandles)
+	 || !m_denseToSparse.reserve(_newCap, m_maxHandles)
+	 || !m_sparseNodes.reserve(_newCap, m_maxHandles))
+		return false; // Out of memory? The pages that were committed will be used by the next grow.
+
+	// Use all the committed memory.
+	size_t newCap = m_values.capacity();
+	newCap = handle_pool_type::MinSizeT(newCap, m_denseToSparse.capacity());
+	newCap = handle_pool_type::MinSizeT(newCap, m_sparseNodes.capacity());
+	m_capacity.store(handle_pool_type::MinSizeT(newCap, m_maxHandles), std::memory_order_relaxed);
+
+	return true;
+}
+
+template <typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+template <typename Func, typename Executor>
+void
+DenseHandlePool<T, IntegerType, MaxHandles, Policy>::parallel_for_each(Func _func, Executor& _executor)
+{
+	struct Context
+	{
+		T*     m_values;
+		Func*  m_func;
+		size_t m_count;
+		size_t m_chunkBytes;
+	};
+
+	// Same chunks as HandlePool::parallel_for_each, but over the packed elements.
+	auto pageSize = Array<T>::GetGranularity();
+	size_t chunkBytes = (HDL::kParallelChunkMinBytes + pageSize - 1) / pageSize * pageSize;
+	size_t count = size();
+	Context context = { m_values.data(), &_func, count, chunkBytes };
+
+	HDL::ParallelTask task;
+	task.m_context = &context;
+	task.m_function = [](const void* _context, size_t _taskIndex)
+	{
+		auto& context = *(const Context*)_context;
+		size_t begin = handle_pool_type::MinSizeT((_taskIndex * context.m_chunkBytes + sizeof(T) - 1) / sizeof(T), context.m_count);
+		size_t end   = handle_pool_type::MinSizeT(((_taskIndex + 1) * context.m_chunkBytes + sizeof(T) - 1) / sizeof(T), context.m_count);
+		for (size_t i = begin; i < end; ++i)
+			(*context.m_func)(context.m_values[i]);
+	};
+
+	size_t numChunks = (count * sizeof(T) + chunkBytes - 1) / chunkBytes;
+	if (numChunks > 0)
+		_executor(numChunks, task);
+}
+
+// Pool split in kShardCount HandlePools (shards), used by Handle with DefaultPolicy::kShardCount > 1.
+// The high bits of the handle index are the shard, and each shard has its own reservation, free list, growth and mutex. 
+// Each thread creates its elements in its home shard, so threads that create and destroy their own elements don't share any state.
+// Destroying an element of another shard invalidates the handle and destroys the element immediately, but the index is pushed 
+// to the shard's inbox (lock-free) instead of its free list, and it's reused when the shard would otherwise have to grow.
+template <typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+class ShardedHandlePool
+{
+public:
+	struct ShardPolicy : Policy { static const size_t kShardCount = 0; };
+
+	typedef ShardedHandlePool<T, IntegerType, MaxHandles, Policy>   this_type;
+	typedef HandlePool<T, IntegerType, MaxHandles, ShardPolicy>      shard_pool_type; // Same handle layout, the indices of a shard are in its range.
+	typedef IntegerType                                              integer_type;
+	typedef typename shard_pool_type::index_type                     index_type;
+	static constexpr integer_type kInvalid = shard_pool_type::kInvalid;
+
+	ShardedHandlePool() : ShardedHandlePool(kMaxHandles) {}
+	explicit ShardedHandlePool(size_t _maxHandles, size_t _poolId = 0);
+
+	ShardedHandlePool(const this_type&) = delete;
+	this_type& operator= (this_type&) = delete;
+
+	template <class ... Args>
+	integer_type create  (Args&&... _args);
+	bool         destroy (integer_type _handle);
+	T*           get     (integer_type _handle)               { return shard(_handle).get(ToShardHandle(_handle)); }
+	bool         is_valid(integer_type _handle) const         { return shard(_handle).is_valid(ToShardHandle(_handle)); }
+	bool         try_read(integer_type _handle, T& _out) const { return shard(_handle).try_read(ToShardHandle(_handle), _out); }
+
+	// Per-element lock (see Policy::kNodeLocks).
+	T*           lock    (integer_type _handle)               { return shard(_handle).lock(ToShardHandle(_handle)); }
+	void         unlock  (integer_type _handle)               { shard(_handle).unlock(ToShardHandle(_handle)); }
+	struct Locked : shard_pool_type::Locked 
+	{ 
+		Locked(this_type& _pool, integer_type _handle) : shard_pool_type::Locked(_pool.shard(_handle), ToShardHandle(_handle)) {} 
+	};
+
+	// Batch versions, create_n creates the elements by batches in the home shard first (like create).
+	template <typename HandleType, class ... Args>
+	size_t       create_n (HandleType* _outHandles, size_t _count, const Args&... _args);
+	template <typename HandleType>
+	size_t       destroy_n(const HandleType* _handles, size_t _count);
+	template <typename HandleType>
+	size_t       get_n    (const HandleType* _handles, T** _outElements, size_t _count);
+
+	size_t       size    () const;
+	size_t       capacity() const;
+	size_t       max_size() const;
+	size_t       retired_count() const;
+
+	bool         reserve (size_t _newCap);
+	size_t       shrink_to_fit();
+
+	template <typename Func>
+	void         for_each(Func _func)                         { for (auto& shard : m_shards) shard.m_pool.for_each(_func); }
+	template <typename Func, typename Executor>
+	void         parallel_for_each(Func _func, Executor& _executor) { for (auto& shard : m_shards) shard.m_pool.parallel_for_each(_func, _executor); }
+
+	static const size_t kMaxHandles     = shard_pool_type::kMaxHandles;
+	static const size_t kVersionMask    = shard_pool_type::kVersionMask;
+	static const size_t kPoolIdNumBits  = shard_pool_type::kPoolIdNumBits;
+	static const size_t kMaxPoolId      = shard_pool_type::kMaxPoolId;
+	static const size_t kShardCount     = Policy::kShardCount;
+	static const size_t kShardNumBits   = shard_pool_type::CeilLog2(kShardCount - 1);
+	static const size_t kShardShift     = shard_pool_type::kIndexNumBits - kShardNumBits;
+	static const size_t kShardIndexCount = (size_t)1 << kShardShift; // Size of the index range of each shard.
+
+	static index_type   GetIndex  (integer_type _handle)             { return shard_pool_type::GetIndex(_handle); }
+	static size_t       GetVersion(integer_type _handle)             { return shard_pool_type::GetVersion(_handle); }
+	static size_t       GetPoolId (integer_type _handle)             { return shard_pool_type::GetPoolId(_handle); }
+	static integer_type GetID     (index_type _index, size_t _version) { return shard_pool_type::GetID(_index, _version); }
+	static size_t       GetShard  (integer_type _handle)             { return GetIndex(_handle) >> kShardShift; }
+
+	static_assert((kShardCount & (kShardCount - 1)) == 0, "DefaultPolicy::kShardCount must be a power of two.");
+	static_assert(kShardNumBits < shard_pool_type::kIndexNumBits, "There are not enough indices for DefaultPolicy::kShardCount shards.");
+	static_assert(shard_pool_type::kIndexNumBits < 32, "ShardedHandlePool only supports up to 2^32 - 1 handles.");
+	static_assert(Policy::kMagazineSize == 0, "ShardedHandlePool doesn't support magazines, the home shards already keep the threads apart.");
+	static_assert(!Policy::kDeferredDestruction, "ShardedHandlePool doesn't support deferred destruction.");
+	static_assert(!Policy::kRefCounting, "ShardedHandlePool doesn't support pins.");
+	static_assert(!Policy::kReplaceable, "ShardedHandlePool doesn't support replacing elements.");
+
+private:
+	// The index of the handle of a shard is relative to the beginning of the shard's range (kInvalid stays kInvalid, it's in the last shard).
+	static integer_type ToShardHandle(integer_type _handle) { return _handle == kInvalid ? kInvalid : (integer_type)(_handle & ~((kShardCount - 1) << kShardShift)); }
+	static integer_type ToHandle(size_t _shard, integer_type _shardHandle) { return _shardHandle == kInvalid ? kInvalid : (integer_type)(_shardHandle | (_shard << kShardShift)); }
+
+	// Shard of the calling thread, assigned round-robin the first time it uses a pool of this type.
+	static size_t GetHomeShard()
+	{
+		static std::atomic<size_t> s_threadCount { 0 };
+		static thread_local size_t s_homeShard = s_threadCount.fetch_add(1, std::memory_order_relaxed) % kShardCount;
+		return s_homeShard;
+	}
+
+	shard_pool_type&       shard(integer_type _handle)       { return m_shards[GetShard(_handle)].m_pool; }
+	const shard_pool_type& shard(integer_type _handle) const { return m_shards[GetShard(_handle)].m_pool; }
+
+	struct Shard
+	{
+		shard_pool_type m_pool;
+		char            m_padding[64]; // Keeps the mutex and counters of neighbouring shards on different cache lines.
+	};
+
+	Shard m_shards[kShardCount];
+};
+
+template <typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+ShardedHandlePool<T, IntegerType, MaxHandles, Policy>::ShardedHandlePool(size_t _maxHandles, size_t _poolId)
+{
+	HDL_ASSERT(_maxHandles <= kMaxHandles, "The handle format can't address more than MaxHandles elements.");
+	size_t maxHandles = shard_pool_type::MinSizeT(_maxHandles, kMaxHandles);
+
+	// Split the limit evenly. The last index of the last shard is never used, with the max version its handle would be kInvalid.
+	for (size_t i = 0; i < kShardCount; ++i)
+	{
+		size_t indexCount = i == kShardCount - 1 ? kShardIndexCount - 1 : kShardIndexCount;
+		size_t shardMaxHandles = maxHandles / kShardCount + (i < maxHandles % kShardCount ? 1 : 0);
+		m_shards[i].m_pool.initShard(shard_pool_type::MinSizeT(shardMaxHandles, indexCount), indexCount, _poolId);
+	}
+}
+
+template <typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+template <class ... Args>
+IntegerType
+ShardedHandlePool<T, IntegerType, MaxHandles, Policy>::create(Args&&... _args)
+{
+	// Use the home shard, the other ones only if it's full.
+	// Note: The arguments are only forwarded to the constructor of T once the creation can't fail anymore, they can be forwarded again.
+	size_t homeShard = GetHomeShard();
+	for (size_t i = 0; i < kShardCount; ++i)
+	{
+		size_t shardIndex = (homeShard + i) % kShardCount;
+		integer_type handle = m_shards[shardIndex].m_pool.create(std::forward<Args>(_args)...);
+		if (handle != kInvalid)
+			return ToHandle(shardIndex, handle);
+	}
+
+	return kInvalid; // MaxHandles reached or out-of-memory.
+}
+
+template <typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+bool
+ShardedHandlePool<T, IntegerType, MaxHandles, Policy>::destroy(integer_type _handle)
+{
+	size_t shardIndex = GetShard(_handle);
+	if (shardIndex == GetHomeShard())
+		return m_shards[shardIndex].m_pool.destroy(ToShardHandle(_handle));
+
+	// Leave the free list (and the mutex) of the other shard to its threads.
+	return m_shards[shardIndex].m_pool.destroyToInbox(ToShardHandle(_handle));
+}
+
+template <typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+template <typename HandleType, class ... Args>
+size_t
+ShardedHandlePool<T, IntegerType, MaxHandles, Policy>::create_n(HandleType* _outHandles, size_t _count, const Args&... _args)
+{
+	size_t numCreated = 0;
+
+	size_t homeShard = GetHomeShard();
+	for (size_t i = 0; i < kShardCount && numCreated < _count; ++i)
+	{
+		size_t shardIndex = (homeShard + i) % kShardCount;
+
+		// The shard sets the handles it couldn't create to kInvalid, the next shard overwrites them.
+		size_t numShardCreated = m_shards[shardIndex].m_pool.create_n(_outHandles + numCreated, _count - numCreated, _args...);
+		for (size_t j = numCreated; j < numCreated + numShardCreated; ++j)
+			_outHandles[j] = HandleType(ToHandle(shardIndex, _outHandles[j]));
+		numCreated += numShardCreated;
+	}
+
+	return numCreated;
+}
+
+template <typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+template <typename HandleType>
+size_t
+ShardedHandlePool<T, IntegerType, MaxHandles, Policy>::destroy_n(const HandleType* _handles, size_t _count)
+{
+	size_t numDestroyed = 0;
+	for (size_t i = 0; i < _count; ++i)
+		numDestroyed += destroy(_handles[i]);
+
+	return numDestroyed;
+}
+
+template <typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+template <typename HandleType>
+size_t
+ShardedHandlePool<T, IntegerType, MaxHandles, Policy>::get_n(const HandleType* _handles, T** _outElements, size_t _count)
+{
+	size_t numValid = 0;
+
+	for (size_t i = 0; i < _count; ++i)
+	{
+		T* element = get(_handles[i]);
+		_outElements[i] = element;
+		numValid += element != nullptr;
+	}
+
+	return numValid;
+}
+
+template <typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+size_t
+ShardedHandlePool<T, IntegerType, MaxHandles, Policy>::size() const
+{
+	size_t count = 0;
+	for (auto& shard : m_shards)
+		count += shard.m_pool.size();
+
+	return count;
+}
+
+template <typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+size_t
+ShardedHandlePool<T, IntegerType, MaxHandles, Policy>::capacity() const
+{
+	size_t count = 0;
+	for (auto& shard : m_shards)
+		count += shard.m_pool.capacity();
+
+	return count;
+}
+
+template <typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+size_t
+ShardedHandlePool<T, IntegerType, MaxHandles, Policy>::max_size() const
+{
+	size_t count = 0;
+	for (auto& shard : m_shards)
+		count += shard.m_pool.max_size();
+
+	return count;
+}
+
+template <typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+size_t
+ShardedHandlePool<T, IntegerType, MaxHandles, Policy>::retired_count() const
+{
+	size_t count = 0;
+	for (auto& shard : m_shards)
+		count += shard.m_pool.retired_count();
+
+	return count;
+}
+
+template <typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+bool
+ShardedHandlePool<T, IntegerType, MaxHandles, Policy>::reserve(size_t _newCap)
+{
+	if (_newCap > max_size())
+		return false;
+
+	// Each thread creates in its own shard, so reserve evenly (within the limit of each shard).
+	size_t shardCap = (_newCap + kShardCount - 1) / kShardCount;
+	bool success = true;
+	for (auto& shard : m_shards)
+		success &= shard.m_pool.reserve(shard_pool_type::MinSizeT(shardCap, shard.m_pool.max_size()));
+
+	return success;
+}
+
+template <typename T, typename IntegerType, size_t MaxHandles, typename Policy>
+size_t
+ShardedHandlePool<T, IntegerType, MaxHandles, Policy>::shrink_to_fit()
+{
+	// Note: The nodes in the inboxes are not in the free lists, they are not released.
+	size_t releasedBytes = 0;
+	for (auto& shard : m_shards)
+		releasedBytes += shard.m_pool.shrink_to_fit();
+
+	return releasedBytes;
+}
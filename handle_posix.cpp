@@ -0,0 +1,184 @@
+#ifndef _WIN32
+
+#include "handle.h"
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+namespace HDL
+{
+namespace VirtualMemory
+{
+	// Size of the huge pages used by Reserve(_size, true). 
+	// Transparent huge pages are PMD sized (2 MiB on x64), hugetlbfs pages have the default huge page size of the system.
+	static size_t ReadHugePageSize()
+	{
+		size_t size = 0;
+	#ifdef HDL_HUGETLB
+		if (FILE* file = fopen("/proc/meminfo", "r"))
+		{
+			char line[256];
+			while (fgets(line, sizeof(line), file))
+			{
+				unsigned long sizeKiB;
+				if (sscanf(line, "Hugepagesize: %lu kB", &sizeKiB) == 1)
+				{
+					size = (size_t)sizeKiB * 1024;
+					break;
+				}
+			}
+			fclose(file);
+		}
+	#else
+		if (FILE* file = fopen("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", "r"))
+		{
+			unsigned long sizeBytes;
+			if (fscanf(file, "%lu", &sizeBytes) == 1)
+				size = (size_t)sizeBytes;
+			fclose(file);
+		}
+	#endif
+
+		// Not available (no huge page support, or not Linux), the reservations are still aligned and committed by 2 MiB steps.
+		size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+		if (size < pageSize || (size & (size - 1)) != 0)
+			size = 2 * 1024 * 1024;
+
+		return size;
+	}
+
+	size_t GetPageSize(bool _hugePages)
+	{
+		struct PageSizeInitializer
+		{
+			size_t m_value;
+			size_t m_hugeValue;
+
+			PageSizeInitializer()
+			{
+				m_value = (size_t)sysconf(_SC_PAGESIZE);
+				m_hugeValue = ReadHugePageSize();
+			}
+		} static pageSize;
+
+		return _hugePages ? pageSize.m_hugeValue : pageSize.m_value;
+	}
+
+	// mprotect/madvise require page aligned addresses, but Commit/Decommit accept any range
+	// and work on all the pages containing at least one byte of it (same as VirtualAlloc/VirtualFree).
+	static void GetPageRange(void* _address, size_t _size, char*& _outBegin, size_t& _outSize)
+	{
+		size_t pageSize = GetPageSize();
+		size_t begin = (size_t)_address & ~(pageSize - 1);
+		size_t end = ((size_t)_address + _size + pageSize - 1) & ~(pageSize - 1);
+
+		_outBegin = (char*)begin;
+		_outSize = end - begin;
+	}
+
+	static void* ReserveHuge(size_t _size)
+	{
+		size_t hugePageSize = GetPageSize(true);
+		size_t size = (_size + hugePageSize - 1) & ~(hugePageSize - 1);
+
+	#ifdef HDL_HUGETLB
+		// hugetlbfs mappings are always aligned to the huge page size. The pages are taken from the preallocated pool when committed.
+		auto address = mmap(nullptr, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_HUGETLB, -1, 0);
+
+		HDL_ASSERT(address != MAP_FAILED, strerror(errno));
+
+		return address != MAP_FAILED ? address : nullptr;
+	#else
+		// Reserve one more huge page to be able to align the area, then give back what's outside of it.
+		auto address = mmap(nullptr, size + hugePageSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+		HDL_ASSERT(address != MAP_FAILED, strerror(errno));
+		if (address == MAP_FAILED)
+			return nullptr;
+
+		char* begin = (char*)address;
+		char* alignedBegin = (char*)(((size_t)begin + hugePageSize - 1) & ~(hugePageSize - 1));
+		if (alignedBegin != begin)
+			munmap(begin, alignedBegin - begin);
+		if (alignedBegin + size != begin + size + hugePageSize)
+			munmap(alignedBegin + size, begin + hugePageSize - alignedBegin);
+
+	#ifdef MADV_HUGEPAGE
+		// Only a hint: it fails if transparent huge pages are not available, and they may be disabled system-wide.
+		// The committed huge pages are then backed by huge pages when they are first touched (or later by khugepaged).
+		madvise(alignedBegin, size, MADV_HUGEPAGE);
+	#endif
+
+		return alignedBegin;
+	#endif
+	}
+
+	void* Reserve(size_t _size, bool _hugePages)
+	{
+		if (_hugePages)
+			return ReserveHuge(_size);
+
+		// PROT_NONE + MAP_NORESERVE only takes address space, no memory is committed (nor accounted for) until Commit is called.
+		auto address = mmap(
+			nullptr,
+			_size,
+			PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+			-1,
+			0
+		);
+
+		HDL_ASSERT(address != MAP_FAILED, strerror(errno));
+
+		return address != MAP_FAILED ? address : nullptr;
+	}
+
+	void Release(void* _address, size_t _size, bool _hugePages)
+	{
+		// Huge reservations were rounded up to whole huge pages.
+		if (_hugePages)
+		{
+			size_t hugePageSize = GetPageSize(true);
+			_size = (_size + hugePageSize - 1) & ~(hugePageSize - 1);
+		}
+
+		auto result = munmap(_address, _size);
+
+		HDL_ASSERT(result == 0, strerror(errno));
+		(void)result;
+	}
+
+	bool Commit(void* _address, size_t _size)
+	{
+		char* begin;
+		size_t size;
+		GetPageRange(_address, _size, begin, size);
+
+		// Anonymous pages are zero-filled on first access, and again after being decommitted with MADV_DONTNEED.
+		auto result = mprotect(begin, size, PROT_READ | PROT_WRITE);
+
+		HDL_ASSERT(result == 0, strerror(errno));
+		return result == 0;
+	}
+
+	void Decommit(void* _address, size_t _size)
+	{
+		char* begin;
+		size_t size;
+		GetPageRange(_address, _size, begin, size);
+
+		// Give the physical pages back to the OS (they will read as zeros if committed again),
+		// then make the range inaccessible again like a freshly reserved one.
+		auto result = madvise(begin, size, MADV_DONTNEED);
+		HDL_ASSERT(result == 0, strerror(errno));
+
+		result = mprotect(begin, size, PROT_NONE);
+		HDL_ASSERT(result == 0, strerror(errno));
+		(void)result;
+	}
+}
+}
+
+#endif // _WIN32
@@ -0,0 +1,120 @@
+#pragma once
+
+#include "handle.h"
+#include <thread>
+#include <vector>
+#include <condition_variable>
+
+namespace HDL
+{
+	/// Small thread pool that can be used as the executor of Handle::ParallelForEach.
+	/// The calling thread works too, and tasks are claimed one by one from a shared counter so that faster threads 
+	/// take more of them (the chunks of ParallelForEach are small enough for that to balance the load).
+	/// Only one parallel loop runs at a time, concurrent calls wait for each other.
+	/// @code
+	/// HDL::ThreadPool threadPool;
+	/// EntityID::ParallelForEach([](Entity& _entity) { _entity.update(); }, threadPool);
+	/// @endcode
+	class ThreadPool
+	{
+	public:
+		/// Creates `_numThreads` worker threads. By default, one per hardware thread minus one (for the calling thread).
+		explicit ThreadPool(size_t _numThreads = GetDefaultNumThreads())
+		{
+			m_threads.reserve(_numThreads);
+			for (size_t i = 0; i < _numThreads; ++i)
+				m_threads.emplace_back([this]() { workerLoop(); });
+		}
+
+		~ThreadPool()
+		{
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_stop = true;
+			}
+			m_wakeUp.notify_all();
+
+			for (auto& thread : m_threads)
+				thread.join();
+		}
+
+		ThreadPool(const ThreadPool&) = delete;
+		ThreadPool& operator=(const ThreadPool&) = delete;
+
+		/// Calls _task(i) for every i in [0, _numTasks) on the worker threads and the calling thread, returns when they are all done.
+		void operator()(size_t _numTasks, const ParallelTask& _task)
+		{
+			std::unique_lock<std::mutex> callLock(m_callMutex); // One loop at a time.
+
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_task = &_task;
+				m_numTasks = _numTasks;
+				m_nextTask.store(0, std::memory_order_relaxed);
+				m_generation++;
+			}
+			m_wakeUp.notify_all();
+
+			runTasks(_task, _numTasks);
+
+			// Wait for the workers to finish their last task, and to stop looking at this one.
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_done.wait(lock, [this]() { return m_numBusyThreads == 0; });
+			m_task = nullptr;
+		}
+
+		size_t GetNumThreads() const { return m_threads.size(); }
+
+		static size_t GetDefaultNumThreads()
+		{
+			unsigned numHardwareThreads = std::thread::hardware_concurrency();
+			return numHardwareThreads > 1 ? numHardwareThreads - 1 : 0;
+		}
+
+	private:
+		void runTasks(const ParallelTask& _task, size_t _numTasks)
+		{
+			for (size_t i = m_nextTask.fetch_add(1, std::memory_order_relaxed); i < _numTasks; i = m_nextTask.fetch_add(1, std::memory_order_relaxed))
+				_task(i);
+		}
+
+		void workerLoop()
+		{
+			uint64_t generation = 0;
+
+			std::unique_lock<std::mutex> lock(m_mutex);
+			for (;;)
+			{
+				m_wakeUp.wait(lock, [&]() { return m_stop || (m_task && m_generation != generation); });
+				if (m_stop)
+					return;
+
+				// Read the task while holding the lock. Keeping a reference is safe: the task belongs to the caller, which can't return
+				// before m_numBusyThreads is back to 0.
+				generation = m_generation;
+				const ParallelTask& task = *m_task;
+				size_t numTasks = m_numTasks;
+				m_numBusyThreads++;
+
+				lock.unlock();
+				runTasks(task, numTasks);
+				lock.lock();
+
+				if (--m_numBusyThreads == 0)
+					m_done.notify_all();
+			}
+		}
+
+		std::vector<std::thread> m_threads;
+		std::mutex               m_callMutex;
+		std::mutex               m_mutex;
+		std::condition_variable  m_wakeUp;
+		std::condition_variable  m_done;
+		const ParallelTask*      m_task           = nullptr;
+		size_t                   m_numTasks       = 0;
+		std::atomic<size_t>      m_nextTask       { 0 };
+		uint64_t                 m_generation     = 0;
+		size_t                   m_numBusyThreads = 0;
+		bool                     m_stop           = false;
+	};
+}
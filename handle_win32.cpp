@@ -1,3 +1,5 @@
+#ifdef _WIN32
+
 #include "handle.h"
 #include <string>
 #define WIN32_LEAN_AND_MEAN
@@ -26,11 +28,12 @@ namespace VirtualMemory
 		return errorString;
 	}
 
-	size_t GetPageSize()
+	size_t GetPageSize(bool _hugePages)
 	{
 		struct PageSizeInitializer
 		{
 			size_t m_value;
+			size_t m_hugeValue;
 
 			PageSizeInitializer()
 			{
@@ -38,14 +41,41 @@ namespace VirtualMemory
 				GetSystemInfo(&info);
 
 				m_value = info.dwPageSize;
+
+				// Large pages need to be committed when they are reserved (with MEM_LARGE_PAGES and the SeLockMemoryPrivilege), 
+				// which defeats the purpose of a growable reservation. Only use their size as commit granularity.
+				m_hugeValue = GetLargePageMinimum();
+				if (m_hugeValue == 0)
+					m_hugeValue = 2 * 1024 * 1024;
 			}
 		} static pageSize;
 
-		return pageSize.m_value;
+		return _hugePages ? pageSize.m_hugeValue : pageSize.m_value;
 	}
 
-	void* Reserve(size_t _size)
+	void* Reserve(size_t _size, bool _hugePages)
 	{
+		// Reserving more than needed and releasing it to reserve again at an aligned address inside it is racy, 
+		// try a few times and fall back to an unaligned reservation.
+		if (_hugePages)
+		{
+			size_t hugePageSize = GetPageSize(true);
+			size_t size = (_size + hugePageSize - 1) & ~(hugePageSize - 1);
+
+			for (int i = 0; i < 4; ++i)
+			{
+				auto address = VirtualAlloc(nullptr, size + hugePageSize, MEM_RESERVE, PAGE_READWRITE);
+				if (address == nullptr)
+					break;
+
+				VirtualFree(address, 0, MEM_RELEASE);
+
+				auto alignedAddress = (void*)(((size_t)address + hugePageSize - 1) & ~(hugePageSize - 1));
+				if (VirtualAlloc(alignedAddress, size, MEM_RESERVE, PAGE_READWRITE) != nullptr)
+					return alignedAddress;
+			}
+		}
+
 		auto address = VirtualAlloc(
 			nullptr, // lpAddress
 			_size,
@@ -58,9 +88,10 @@ namespace VirtualMemory
 		return address;
 	}
 
-	void Release(void* _address, size_t _size)
+	void Release(void* _address, size_t _size, bool _hugePages)
 	{
 		(void)_size; // When using MEM_RELEASE, the passed size must be 0. The entire region that was reserved will be released.
+		(void)_hugePages;
 
 		auto success = VirtualFree(
 			_address,
@@ -96,3 +127,5 @@ namespace VirtualMemory
 	}
 }
 }
+
+#endif // _WIN32
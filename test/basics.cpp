@@ -143,4 +143,1212 @@ TEST_CASE("wrapping test", "[basics]")
 	auto wrappingHandle = CharHandle::Create('a');
 	REQUIRE(wrappingHandle != CharHandle::kInvalid);
 	REQUIRE(wrappingHandle == 0);
-}
\ No newline at end of file
+}
+
+TEST_CASE("batch functions", "[basics]")
+{
+	struct BatchTag;
+	using IntHandle = Handle<int, BatchTag, unsigned short, 1000>;
+
+	IntHandle::Reset();
+
+	std::vector<IntHandle> v(600);
+	REQUIRE(IntHandle::CreateN(v.data(), v.size(), 42) == v.size());
+	REQUIRE(IntHandle::Size() == v.size());
+
+	THEN("all handles are unique and valid")
+	{
+		std::set<IntHandle> s(v.begin(), v.end());
+		REQUIRE(s.size() == v.size());
+
+		std::vector<int*> elements(v.size());
+		REQUIRE(IntHandle::GetN(v.data(), elements.data(), v.size()) == v.size());
+		for (auto element : elements)
+			REQUIRE(*element == 42);
+	}
+
+	WHEN("more handles than MaxHandles are requested")
+	{
+		std::vector<IntHandle> more(600);
+		REQUIRE(IntHandle::CreateN(more.data(), more.size(), 1) == 400);
+		REQUIRE(IntHandle::Size() == IntHandle::MaxSize());
+
+		THEN("the remaining handles are invalid")
+		{
+			for (size_t i = 400; i < more.size(); ++i)
+				REQUIRE(more[i] == IntHandle::kInvalid);
+		}
+	}
+
+	WHEN("the handles are destroyed")
+	{
+		REQUIRE(IntHandle::DestroyN(v.data(), v.size()) == v.size());
+		REQUIRE(IntHandle::Size() == 0);
+
+		THEN("they are invalid")
+		{
+			std::vector<int*> elements(v.size());
+			REQUIRE(IntHandle::GetN(v.data(), elements.data(), v.size()) == 0);
+			for (auto element : elements)
+				REQUIRE(element == nullptr);
+
+			REQUIRE(IntHandle::DestroyN(v.data(), v.size()) == 0);
+		}
+	}
+}
+
+TEST_CASE("compact nodes", "[basics]")
+{
+	// The node header is only as big as the version needs: 16 version bits (+1 allocated bit) fit in 4 bytes, next to the int.
+	struct CompactTag;
+	using IntHandle = Handle<int, CompactTag, uint32_t, 64 * 1024>;
+
+	IntHandle::Reset();
+	REQUIRE(IntHandle::Reserve(1));
+	REQUIRE(IntHandle::Capacity() == HDL::VirtualMemory::GetPageSize() / 8);
+
+	// 7 version bits fit in 1 byte, the element shares the next 2 bytes with the free list link.
+	struct SmallTag;
+	using CharHandle = Handle<char, SmallTag, uint16_t, 512>;
+
+	CharHandle::Reset();
+	REQUIRE(CharHandle::Reserve(1));
+	REQUIRE(CharHandle::Capacity() == CharHandle::MaxSize()); // 512 nodes of 4 bytes fit in one page.
+}
+
+struct SeparateVersionsPolicy : HDL::DefaultPolicy { static const bool kSeparateVersions = true; };
+
+TEST_CASE("separate versions", "[basics]")
+{
+	// Big elements, so that the element and version arrays grow at very different rates.
+	struct Big { char m_data[3000]; int m_value; };
+	using BigHandle = Handle<Big, void, uint32_t, 5000, SeparateVersionsPolicy>;
+
+	BigHandle::Reset();
+
+	std::vector<BigHandle> v;
+	for (int i = 0; i < 5000; ++i)
+	{
+		auto h = BigHandle::Create();
+		REQUIRE(h != BigHandle::kInvalid);
+		BigHandle::Get(h)->m_value = i;
+		v.push_back(h);
+	}
+
+	REQUIRE(BigHandle::Create() == BigHandle::kInvalid);
+
+	for (int i = 0; i < 5000; ++i)
+	{
+		REQUIRE(BigHandle::IsValid(v[i]));
+		REQUIRE(BigHandle::Get(v[i])->m_value == i);
+	}
+
+	for (int i = 0; i < 5000; i += 2)
+		REQUIRE(BigHandle::Destroy(v[i]));
+
+	for (int i = 0; i < 5000; ++i)
+	{
+		REQUIRE(BigHandle::IsValid(v[i]) == (i % 2 == 1));
+		REQUIRE((BigHandle::Get(v[i]) != nullptr) == (i % 2 == 1));
+	}
+
+	// Reused nodes get a new version.
+	auto h = BigHandle::Create();
+	REQUIRE(BigHandle::pool_type::GetVersion(h) == 1);
+	REQUIRE(!BigHandle::IsValid(v[BigHandle::pool_type::GetIndex(h)]));
+	REQUIRE(!BigHandle::IsValid(BigHandle()));
+}
+
+struct ChunkedPolicy : HDL::DefaultPolicy { static const bool kChunkedStorage = true; static const size_t kChunkSize = 1024; };
+struct ChunkedSideArraysPolicy : ChunkedPolicy { static const bool kSeparateVersions = true; static const bool kOccupancyBitmap = true; };
+
+template <typename IntHandle>
+void TestChunkedStorage(size_t _nodesPerChunk)
+{
+	IntHandle::Reset();
+
+	// The capacity grows one chunk at a time: 128 nodes of 8 bytes, or 256 nodes of 4 bytes with separate versions.
+	auto first = IntHandle::Create(0);
+	int* firstElement = IntHandle::Get(first);
+	REQUIRE(IntHandle::Capacity() == _nodesPerChunk);
+
+	std::vector<IntHandle> v(1, first);
+	for (int i = 1; i < 2000; ++i)
+		v.push_back(IntHandle::Create(i));
+
+	REQUIRE(IntHandle::Size() == 2000);
+	REQUIRE(IntHandle::Capacity() == 2000);
+	REQUIRE(IntHandle::Create(0) == IntHandle::kInvalid);
+
+	// The elements never move when the storage grows.
+	REQUIRE(IntHandle::Get(first) == firstElement);
+	for (int i = 0; i < 2000; ++i)
+		REQUIRE(*IntHandle::Get(v[i]) == i);
+
+	for (int i = 0; i < 2000; i += 2)
+		REQUIRE(IntHandle::Destroy(v[i]));
+
+	size_t numVisited = 0;
+	IntHandle::ForEach([&numVisited](int& _value) { numVisited += _value % 2; });
+	REQUIRE(numVisited == 1000);
+
+	for (int i = 0; i < 2000; ++i)
+		REQUIRE(IntHandle::IsValid(v[i]) == (i % 2 == 1));
+
+	auto h = IntHandle::Create(42);
+	REQUIRE(*IntHandle::Get(h) == 42);
+}
+
+TEST_CASE("chunked storage", "[basics]")
+{
+	struct ChunkedTag;
+	TestChunkedStorage<Handle<int, ChunkedTag, uint32_t, 2000, ChunkedPolicy>>(128);
+	TestChunkedStorage<Handle<int, ChunkedTag, uint32_t, 2000, ChunkedSideArraysPolicy>>(256);
+}
+
+struct HugePagesPolicy : HDL::DefaultPolicy { static const bool kHugePages = true; };
+
+TEST_CASE("huge pages", "[basics]")
+{
+	using IntHandle = Handle<int, void, uint32_t, 1024 * 1024, HugePagesPolicy>;
+
+	IntHandle::Reset();
+
+	// The storage grows by whole huge pages.
+	const size_t nodesPerHugePage = HDL::VirtualMemory::GetPageSize(true) / 8;
+	auto h = IntHandle::Create(1);
+	REQUIRE(IntHandle::Capacity() == nodesPerHugePage);
+
+	std::vector<IntHandle> v(nodesPerHugePage + 1);
+	REQUIRE(IntHandle::CreateN(v.data(), v.size(), 2) == v.size());
+	REQUIRE(IntHandle::Capacity() == 2 * nodesPerHugePage);
+	REQUIRE(*IntHandle::Get(h) == 1);
+	REQUIRE(*IntHandle::Get(v.back()) == 2);
+
+	REQUIRE(IntHandle::DestroyN(v.data(), v.size()) == v.size());
+	REQUIRE(IntHandle::Destroy(h));
+	REQUIRE(IntHandle::Size() == 0);
+}
+
+struct DensePolicy : HDL::DefaultPolicy { static const bool kDenseStorage = true; };
+
+TEST_CASE("dense storage", "[basics]")
+{
+	using IntHandle = Handle<int, void, uint32_t, 2000, DensePolicy>;
+
+	IntHandle::Reset();
+
+	std::vector<IntHandle> v;
+	for (int i = 0; i < 2000; ++i)
+		v.push_back(IntHandle::Create(i));
+
+	REQUIRE(IntHandle::Size() == 2000);
+	REQUIRE(IntHandle::Create(0) == IntHandle::kInvalid);
+
+	// Destroy every other element.
+	for (int i = 0; i < 2000; i += 2)
+		REQUIRE(IntHandle::Destroy(v[i]));
+	REQUIRE(!IntHandle::Destroy(v[0]));
+
+	REQUIRE(IntHandle::Size() == 1000);
+
+	THEN("the remaining elements are packed and still reachable through their handles")
+	{
+		int sum = 0;
+		for (size_t i = 0; i < IntHandle::Size(); ++i)
+		{
+			int value = IntHandle::Data()[i];
+			REQUIRE(value % 2 == 1);
+			REQUIRE(IntHandle::GetHandle(i) == v[value]);
+			sum += value;
+		}
+		REQUIRE(sum == 1000 * 1000);
+
+		for (int i = 0; i < 2000; ++i)
+		{
+			REQUIRE(IntHandle::IsValid(v[i]) == (i % 2 == 1));
+			if (i % 2 == 1)
+				REQUIRE(*IntHandle::Get(v[i]) == i);
+			else
+				REQUIRE(IntHandle::Get(v[i]) == nullptr);
+		}
+	}
+
+	THEN("the destroyed slots are reused with a new version")
+	{
+		std::vector<IntHandle> more(1000);
+		REQUIRE(IntHandle::CreateN(more.data(), more.size(), 42) == 1000);
+		REQUIRE(IntHandle::Size() == 2000);
+
+		for (auto h : more)
+		{
+			REQUIRE(*IntHandle::Get(h) == 42);
+			REQUIRE(IntHandle::pool_type::GetVersion(h) == 1);
+		}
+
+		REQUIRE(IntHandle::DestroyN(more.data(), more.size()) == 1000);
+		REQUIRE(IntHandle::Size() == 1000);
+	}
+}
+
+struct TreeNode;
+using TreeHandle = Handle<TreeNode, void, uint32_t, 1000, DensePolicy>;
+
+// Creates its children in its constructor, and destroys them in its destructor.
+struct TreeNode
+{
+	TreeHandle m_children[2]; // Invalid by default.
+
+	TreeNode(int _depth)
+	{
+		if (_depth > 0)
+			TreeHandle::CreateN(m_children, 2, _depth - 1);
+	}
+	TreeNode(TreeNode&& _other)
+	{
+		for (int i = 0; i < 2; ++i)
+		{
+			m_children[i] = _other.m_children[i];
+			_other.m_children[i] = TreeHandle();
+		}
+	}
+	~TreeNode()
+	{
+		// Moved-from nodes are destroyed with the pool locked, they must not use it.
+		if (m_children[0] != TreeHandle())
+			TreeHandle::DestroyN(m_children, 2);
+	}
+};
+
+TEST_CASE("dense storage elements using the pool", "[basics]")
+{
+	TreeHandle::Reset();
+
+	// The constructors and destructors run outside of the lock, so they can create and destroy other elements.
+	auto root = TreeHandle::Create(5);
+	REQUIRE(TreeHandle::Size() == 63);
+
+	std::vector<TreeHandle> trees(4);
+	REQUIRE(TreeHandle::CreateN(trees.data(), trees.size(), 3) == 4);
+	REQUIRE(TreeHandle::Size() == 63 + 4 * 15);
+
+	REQUIRE(TreeHandle::Destroy(root));
+	REQUIRE(TreeHandle::Size() == 4 * 15);
+
+	REQUIRE(TreeHandle::DestroyN(trees.data(), trees.size()) == 4);
+	REQUIRE(TreeHandle::Size() == 0);
+}
+
+struct OccupancyBitmapPolicy : HDL::DefaultPolicy { static const bool kOccupancyBitmap = true; };
+
+template <typename IntHandle>
+void TestForEach()
+{
+	IntHandle::Reset();
+
+	std::vector<IntHandle> v;
+	for (int i = 0; i < 1000; ++i)
+		v.push_back(IntHandle::Create(i));
+
+	// Leave holes, including whole 64 nodes blocks.
+	for (int i = 0; i < 1000; ++i)
+	{
+		if (i % 3 == 0 || (i >= 128 && i < 320))
+			IntHandle::Destroy(v[i]);
+	}
+
+	std::set<int> expected;
+	for (int i = 0; i < 1000; ++i)
+	{
+		if (IntHandle::IsValid(v[i]))
+			expected.insert(i);
+	}
+
+	std::vector<int> visited;
+	IntHandle::ForEach([&visited](int& _value) { visited.push_back(_value); });
+
+	REQUIRE(visited.size() == IntHandle::Size());
+	REQUIRE(std::set<int>(visited.begin(), visited.end()) == expected);
+}
+
+TEST_CASE("for each", "[basics]")
+{
+	struct ForEachTag;
+	TestForEach<Handle<int, ForEachTag, uint32_t, 1000>>();
+	TestForEach<Handle<int, ForEachTag, uint32_t, 1000, OccupancyBitmapPolicy>>();
+	TestForEach<Handle<int, ForEachTag, uint32_t, 1000, DensePolicy>>();
+	TestForEach<Handle<int, ForEachTag, uint32_t, 1000, ChunkedSideArraysPolicy>>();
+}
+
+struct BigChunkPolicy  : HDL::DefaultPolicy { typedef HDL::GrowByBytes<1024 * 1024> Growth; };
+struct GeometricPolicy : HDL::DefaultPolicy { typedef HDL::GrowGeometric<2, 1> Growth; };
+
+TEST_CASE("growth policies", "[basics]")
+{
+	const size_t pageSize = HDL::VirtualMemory::GetPageSize();
+
+	GIVEN("the default policy")
+	{
+		using IntHandle = Handle<int, void, uint32_t, 1024 * 1024>;
+		IntHandle::Reset();
+
+		IntHandle::Create(0);
+		size_t cap = IntHandle::Capacity();
+
+		THEN("the pool grows one page at a time")
+		{
+			REQUIRE(cap > 0);
+			REQUIRE(cap <= pageSize / sizeof(int));
+
+			for (size_t i = IntHandle::Size(); i < cap + 1; ++i)
+				IntHandle::Create((int)i);
+
+			REQUIRE(IntHandle::Capacity() > cap);
+			REQUIRE(IntHandle::Capacity() <= 2 * pageSize / sizeof(int));
+		}
+	}
+
+	GIVEN("a fixed size policy")
+	{
+		using IntHandle = Handle<int, void, uint32_t, 1024 * 1024, BigChunkPolicy>;
+		IntHandle::Reset();
+
+		IntHandle::Create(0);
+
+		THEN("the first growth commits the whole chunk")
+		{
+			REQUIRE(IntHandle::Capacity() * 64 >= 1024 * 1024); // Nodes are much smaller than 64 bytes.
+		}
+	}
+
+	GIVEN("a geometric policy")
+	{
+		using IntHandle = Handle<int, void, uint32_t, 1024 * 1024, GeometricPolicy>;
+		IntHandle::Reset();
+
+		THEN("the capacity doubles each time the pool is full")
+		{
+			IntHandle::Create(0);
+			size_t cap = IntHandle::Capacity();
+
+			for (int step = 0; step < 4; ++step)
+			{
+				while (IntHandle::Size() < cap + 1)
+					IntHandle::Create(0);
+
+				REQUIRE(IntHandle::Capacity() >= 2 * cap);
+				cap = IntHandle::Capacity();
+			}
+		}
+	}
+
+	GIVEN("a policy with a step bigger than MaxHandles")
+	{
+		using IntHandle = Handle<int, void, uint32_t, 100, BigChunkPolicy>;
+		IntHandle::Reset();
+
+		THEN("the capacity doesn't go above MaxHandles")
+		{
+			IntHandle::Create(0);
+			REQUIRE(IntHandle::Capacity() == IntHandle::MaxSize());
+		}
+	}
+}
+
+struct DeferredPolicy : HDL::DefaultPolicy { static const bool kDeferredDestruction = true; };
+
+struct DestructorCounter
+{
+	int* m_counter;
+	DestructorCounter(int* _counter) : m_counter(_counter) {}
+	DestructorCounter(DestructorCounter&& _other) : m_counter(_other.m_counter) { _other.m_counter = nullptr; } // Moved by the dense pools.
+	~DestructorCounter() { if (m_counter) (*m_counter)++; }
+};
+
+TEST_CASE("deferred destruction", "[basics]")
+{
+	using CounterHandle = Handle<DestructorCounter, void, uint32_t, 1024, DeferredPolicy>;
+
+	CounterHandle::Reset();
+
+	int numDestroyed = 0;
+	auto h = CounterHandle::Create(&numDestroyed);
+
+	GIVEN("no read section in progress")
+	{
+		REQUIRE(CounterHandle::Destroy(h));
+		REQUIRE(CounterHandle::Get(h) == nullptr);
+
+		THEN("collect destroys the element")
+		{
+			REQUIRE(CounterHandle::Collect() == 1);
+			REQUIRE(numDestroyed == 1);
+			REQUIRE(CounterHandle::Size() == 0);
+		}
+	}
+
+	GIVEN("a read section in progress")
+	{
+		auto guard = new CounterHandle::ReadGuard;
+		auto ptr = CounterHandle::Get(h);
+		REQUIRE(ptr != nullptr);
+
+		REQUIRE(CounterHandle::Destroy(h));
+
+		THEN("the handle is invalid but the element is not destroyed")
+		{
+			REQUIRE(CounterHandle::Get(h) == nullptr);
+			REQUIRE(CounterHandle::Collect() == 0);
+			REQUIRE(numDestroyed == 0);
+			REQUIRE(CounterHandle::Size() == 1);
+			REQUIRE(ptr->m_counter == &numDestroyed);
+		}
+
+		WHEN("the read section ends")
+		{
+			delete guard;
+			guard = nullptr;
+
+			THEN("collect destroys the element")
+			{
+				REQUIRE(CounterHandle::Collect() == 1);
+				REQUIRE(numDestroyed == 1);
+				REQUIRE(CounterHandle::Size() == 0);
+			}
+		}
+
+		WHEN("a read section starts after the destruction")
+		{
+			delete guard;
+			guard = nullptr;
+			CounterHandle::ReadGuard lateGuard;
+
+			THEN("it doesn't block the destruction")
+			{
+				REQUIRE(CounterHandle::Collect() == 1);
+				REQUIRE(numDestroyed == 1);
+			}
+		}
+
+		delete guard;
+	}
+
+	WHEN("the pool is reset before collecting")
+	{
+		REQUIRE(CounterHandle::Destroy(h));
+		CounterHandle::Reset();
+
+		THEN("the element is destroyed")
+		{
+			REQUIRE(numDestroyed == 1);
+		}
+	}
+}
+
+struct RefCountingPolicy : HDL::DefaultPolicy { static const bool kRefCounting = true; };
+
+TEST_CASE("pinned elements", "[basics]")
+{
+	using CounterHandle = Handle<DestructorCounter, void, uint32_t, 1024, RefCountingPolicy>;
+
+	CounterHandle::Reset();
+
+	int numDestroyed = 0;
+	auto h = CounterHandle::Create(&numDestroyed);
+
+	GIVEN("no pin")
+	{
+		REQUIRE(CounterHandle::Destroy(h));
+		REQUIRE(numDestroyed == 1);
+		REQUIRE(CounterHandle::Size() == 0);
+		REQUIRE(CounterHandle::Acquire(h) == nullptr);
+		REQUIRE(!CounterHandle::Pinned(h));
+	}
+
+	GIVEN("two pins")
+	{
+		auto ptr = CounterHandle::Acquire(h);
+		REQUIRE(ptr == CounterHandle::Get(h));
+		auto pinned = new CounterHandle::Pinned(h);
+		REQUIRE(pinned->get() == ptr);
+
+		REQUIRE(CounterHandle::Destroy(h));
+		REQUIRE(!CounterHandle::Destroy(h));
+
+		THEN("the handle is invalid but the element is not destroyed")
+		{
+			REQUIRE(CounterHandle::Get(h) == nullptr);
+			REQUIRE(CounterHandle::Acquire(h) == nullptr);
+			REQUIRE(numDestroyed == 0);
+			REQUIRE(CounterHandle::Size() == 1);
+			REQUIRE((*pinned)->m_counter == &numDestroyed);
+		}
+
+		WHEN("the pins are released")
+		{
+			CounterHandle::Release(h);
+			REQUIRE(numDestroyed == 0);
+			delete pinned;
+			pinned = nullptr;
+
+			THEN("the last one destroys the element")
+			{
+				REQUIRE(numDestroyed == 1);
+				REQUIRE(CounterHandle::Size() == 0);
+
+				auto h2 = CounterHandle::Create(&numDestroyed);
+				REQUIRE(CounterHandle::Acquire(h) == nullptr);
+				REQUIRE(CounterHandle::Destroy(h2));
+				REQUIRE(numDestroyed == 2);
+			}
+		}
+
+		delete pinned;
+	}
+
+	GIVEN("a pin that is still held when the pool is reset")
+	{
+		REQUIRE(CounterHandle::Acquire(h) != nullptr);
+		REQUIRE(CounterHandle::Destroy(h));
+		REQUIRE(numDestroyed == 0);
+
+		CounterHandle::Reset();
+		REQUIRE(numDestroyed == 1);
+	}
+
+	GIVEN("a pinned element that is not destroyed")
+	{
+		{
+			CounterHandle::Pinned pinned(h);
+			REQUIRE(pinned);
+		}
+		REQUIRE(numDestroyed == 0);
+		REQUIRE(CounterHandle::DestroyN(&h, 1) == 1);
+		REQUIRE(numDestroyed == 1);
+	}
+}
+
+struct ReplaceablePolicy : HDL::DefaultPolicy { static const bool kDeferredDestruction = true; static const bool kReplaceable = true; };
+
+TEST_CASE("replace", "[basics]")
+{
+	struct Counted
+	{
+		int  m_value;
+		int* m_counter;
+		Counted(int _value, int* _counter) : m_value(_value), m_counter(_counter) {}
+		~Counted() { (*m_counter)++; }
+	};
+
+	using CountedHandle = Handle<Counted, void, uint32_t, 1024, ReplaceablePolicy>;
+
+	CountedHandle::Reset();
+
+	int numDestroyed = 0;
+	auto h = CountedHandle::Create(1, &numDestroyed);
+
+	GIVEN("no read section in progress")
+	{
+		REQUIRE(CountedHandle::Replace(h, 2, &numDestroyed));
+		REQUIRE(CountedHandle::Get(h)->m_value == 2);
+		REQUIRE(CountedHandle::Collect() == 1);
+		REQUIRE(numDestroyed == 1);
+
+		// The spare slot is free again.
+		REQUIRE(CountedHandle::Replace(h, 3, &numDestroyed));
+		REQUIRE(CountedHandle::Get(h)->m_value == 3);
+		REQUIRE(CountedHandle::Size() == 1);
+
+		REQUIRE(CountedHandle::Destroy(h));
+		REQUIRE(!CountedHandle::Replace(h, 4, &numDestroyed));
+		REQUIRE(CountedHandle::Collect() == 2);
+		REQUIRE(numDestroyed == 3);
+		REQUIRE(CountedHandle::Size() == 0);
+	}
+
+	GIVEN("a read section in progress")
+	{
+		auto guard = new CountedHandle::ReadGuard;
+		auto oldPtr = CountedHandle::Get(h);
+
+		REQUIRE(CountedHandle::Replace(h, 2, &numDestroyed));
+
+		THEN("the old element is not destroyed before the end of the read section")
+		{
+			REQUIRE(CountedHandle::Get(h)->m_value == 2);
+			REQUIRE(oldPtr->m_value == 1);
+			REQUIRE(CountedHandle::Collect() == 0);
+			REQUIRE(numDestroyed == 0);
+
+			// The old element still uses the spare slot.
+			REQUIRE(!CountedHandle::Replace(h, 3, &numDestroyed));
+		}
+
+		WHEN("the handle is destroyed too")
+		{
+			REQUIRE(CountedHandle::Destroy(h));
+			REQUIRE(CountedHandle::Get(h) == nullptr);
+
+			delete guard;
+			guard = nullptr;
+
+			THEN("both elements are destroyed and the node is freed")
+			{
+				REQUIRE(CountedHandle::Collect() == 2);
+				REQUIRE(numDestroyed == 2);
+				REQUIRE(CountedHandle::Size() == 0);
+			}
+		}
+
+		WHEN("the pool is reset")
+		{
+			delete guard;
+			guard = nullptr;
+			CountedHandle::Reset();
+
+			THEN("both elements are destroyed")
+			{
+				REQUIRE(numDestroyed == 2);
+			}
+		}
+
+		delete guard;
+	}
+}
+
+struct NodeLocksPolicy : HDL::DefaultPolicy { static const bool kNodeLocks = true; };
+
+TEST_CASE("node locks", "[basics]")
+{
+	using IntHandle = Handle<int, void, uint32_t, 1024, NodeLocksPolicy>;
+
+	IntHandle::Reset();
+
+	auto h = IntHandle::Create(1);
+	{
+		auto locked = IntHandle::GetLocked(h);
+		REQUIRE(locked);
+		*locked = 2;
+
+		// Get/IsValid ignore the lock.
+		REQUIRE(IntHandle::IsValid(h));
+		REQUIRE(IntHandle::Get(h) == locked.get());
+	}
+	REQUIRE(*IntHandle::Get(h) == 2);
+
+	// The lock is released, it can be taken again.
+	REQUIRE(*IntHandle::GetLocked(h) == 2);
+
+	REQUIRE(IntHandle::Destroy(h));
+	REQUIRE(!IntHandle::GetLocked(h));
+	REQUIRE(!IntHandle::GetLocked(IntHandle()));
+
+	// 7 bits of version + the allocated bit fill a byte, the lock bit is the top bit of a uint16_t.
+	using SmallHandle = Handle<int, void, uint16_t, 512, NodeLocksPolicy>;
+	SmallHandle::Reset();
+	auto s = SmallHandle::Create(3);
+	REQUIRE(*SmallHandle::GetLocked(s) == 3);
+	REQUIRE(SmallHandle::Destroy(s));
+}
+
+TEST_CASE("try read", "[basics]")
+{
+	struct Vec3 { float x, y, z; };
+	using Vec3Handle = Handle<Vec3>;
+
+	Vec3Handle::Reset();
+
+	auto h = Vec3Handle::Create(Vec3{ 1.0f, 2.0f, 3.0f });
+	Vec3 v = { 0.0f, 0.0f, 0.0f };
+	REQUIRE(Vec3Handle::TryRead(h, v));
+	REQUIRE(v.x == 1.0f);
+	REQUIRE(v.y == 2.0f);
+	REQUIRE(v.z == 3.0f);
+
+	REQUIRE(Vec3Handle::Destroy(h));
+	auto h2 = Vec3Handle::Create(Vec3{ 4.0f, 5.0f, 6.0f });
+	REQUIRE(!Vec3Handle::TryRead(h, v));
+	REQUIRE(!Vec3Handle::TryRead(Vec3Handle(), v));
+	REQUIRE(v.x == 1.0f);
+
+	REQUIRE(Vec3Handle::TryRead(h2, v));
+	REQUIRE(v.z == 6.0f);
+}
+
+struct ShardedPolicy : HDL::DefaultPolicy { static const size_t kShardCount = 4; };
+
+TEST_CASE("sharded pool", "[basics]")
+{
+	using IntHandle = Handle<int, void, uint32_t, 1024, ShardedPolicy>;
+	using pool_type = IntHandle::pool_type;
+
+	// The last index of the last shard is left out, its handle could be kInvalid.
+	IntHandle::Reset();
+	REQUIRE(IntHandle::MaxSize() == 1023);
+
+	// The elements are created in the home shard of the thread first.
+	IntHandle h = IntHandle::Create(1);
+	size_t homeShard = pool_type::GetShard(h);
+	std::vector<IntHandle> v(300);
+	REQUIRE(IntHandle::CreateN(v.data(), v.size(), 2) == 300);
+	for (size_t i = 0; i < 255; ++i)
+		REQUIRE(pool_type::GetShard(v[i]) == homeShard);
+
+	// Then in the other shards once it's full.
+	REQUIRE(pool_type::GetShard(v[255]) != homeShard);
+	REQUIRE(*IntHandle::Get(v[255]) == 2);
+	REQUIRE(IntHandle::Size() == 301);
+
+	// Destroying the elements of the other shards from this thread goes through their inbox.
+	REQUIRE(IntHandle::DestroyN(v.data() + 255, 45) == 45);
+	REQUIRE(!IntHandle::IsValid(v[255]));
+	REQUIRE(!IntHandle::Destroy(v[255]));
+	REQUIRE(IntHandle::DestroyN(v.data(), 255) == 255);
+	REQUIRE(IntHandle::Destroy(h));
+	REQUIRE(!IntHandle::Destroy(IntHandle()));
+
+	// All the indices can be used again.
+	std::vector<IntHandle> all(1100);
+	REQUIRE(IntHandle::CreateN(all.data(), all.size(), 3) == 1023);
+	REQUIRE(IntHandle::Size() == 1023);
+	REQUIRE(IntHandle::Create(4) == IntHandle::kInvalid);
+	std::set<uint32_t> unique(all.begin(), all.begin() + 1023);
+	REQUIRE(unique.size() == 1023);
+	REQUIRE(unique.count(IntHandle::kInvalid) == 0);
+	REQUIRE(IntHandle::DestroyN(all.data(), all.size()) == 1023);
+
+	// The runtime limit is split between the shards.
+	IntHandle::Reset(1001);
+	REQUIRE(IntHandle::MaxSize() == 1001);
+	REQUIRE(IntHandle::CreateN(all.data(), all.size(), 5) == 1001);
+
+	int sum = 0;
+	IntHandle::ForEach([&sum](int& _value) { sum += _value; });
+	REQUIRE(sum == 5 * 1001);
+}
+
+template <typename Policy>
+struct PoolIdPolicy : Policy { static const size_t kPoolIdNumBits = 4; };
+
+template <typename CounterHandle>
+void TestPoolInstances()
+{
+	int numDestroyed = 0;
+	CounterHandle::Reset();
+
+	{
+		HDL::Pool<CounterHandle> poolA;
+		HDL::Pool<CounterHandle> poolB;
+
+		std::vector<CounterHandle> handlesA(100);
+		REQUIRE(poolA.CreateN(handlesA.data(), handlesA.size(), &numDestroyed) == 100);
+
+		// Each pool has its own limit, and the global pool is untouched.
+		REQUIRE(poolA.Create(&numDestroyed) == CounterHandle::kInvalid);
+		auto handleB = poolB.Create(&numDestroyed);
+		REQUIRE(handleB != CounterHandle::kInvalid);
+		REQUIRE(poolB.Size() == 1);
+		REQUIRE(CounterHandle::Size() == 0);
+
+		// The handles of the other pools are rejected, even with a valid index and version.
+		REQUIRE(CounterHandle::pool_type::GetIndex(handleB) == CounterHandle::pool_type::GetIndex(handlesA[0]));
+		REQUIRE(handleB != handlesA[0]);
+		REQUIRE(!poolA.IsValid(handleB));
+		REQUIRE(poolA.Get(handleB) == nullptr);
+		REQUIRE(!poolA.Destroy(handleB));
+		REQUIRE(!CounterHandle::IsValid(handleB));
+		REQUIRE(CounterHandle::Get(handleB) == nullptr);
+		REQUIRE(!CounterHandle::Destroy(handleB));
+		REQUIRE(poolB.Get(handleB) != nullptr);
+
+		REQUIRE(poolB.Destroy(handleB));
+		REQUIRE(numDestroyed == 1);
+		REQUIRE(poolA.IsValid(handlesA[0]));
+
+		// Resetting a pool only destroys its elements.
+		poolB.Create(&numDestroyed);
+		poolA.Reset();
+		REQUIRE(numDestroyed == 101);
+		REQUIRE(poolA.Size() == 0);
+		REQUIRE(poolB.Size() == 1);
+	}
+
+	// Destroying a pool destroys its elements.
+	REQUIRE(numDestroyed == 102);
+}
+
+struct MagazineDeferredPolicy : HDL::DefaultPolicy { static const size_t kMagazineSize = 8; static const bool kDeferredDestruction = true; };
+
+TEST_CASE("pool instances", "[basics]")
+{
+	struct InstanceTag;
+	TestPoolInstances<Handle<DestructorCounter, InstanceTag, uint32_t, 100, PoolIdPolicy<HDL::DefaultPolicy>>>();
+	TestPoolInstances<Handle<DestructorCounter, InstanceTag, uint32_t, 100, PoolIdPolicy<DensePolicy>>>();
+	TestPoolInstances<Handle<DestructorCounter, InstanceTag, uint32_t, 100, PoolIdPolicy<ShardedPolicy>>>();
+
+	// The pool ids are reused once the pools are destroyed, but only when there is no fresh one left, oldest first.
+	using IntHandle = Handle<int, InstanceTag, uint32_t, 100, PoolIdPolicy<HDL::DefaultPolicy>>;
+	IntHandle previousHandle;
+	for (size_t i = 0; i < 2 * IntHandle::pool_type::kMaxPoolId; ++i)
+	{
+		HDL::Pool<IntHandle> pool;
+		IntHandle handle = pool.Create(1);
+		REQUIRE(IntHandle::pool_type::GetPoolId(handle) == i % IntHandle::pool_type::kMaxPoolId + 1);
+
+		// The handles of the destroyed pool are rejected by the next one, even with the same index and version.
+		if (i > 0)
+		{
+			REQUIRE(IntHandle::pool_type::GetIndex(previousHandle) == IntHandle::pool_type::GetIndex(handle));
+			REQUIRE(!pool.IsValid(previousHandle));
+			REQUIRE(pool.Get(previousHandle) == nullptr);
+			REQUIRE(!pool.Destroy(previousHandle));
+		}
+		previousHandle = handle;
+	}
+
+	// Each pool has its own per-thread data: a read section of a pool doesn't prevent using another one.
+	using MagazineHandle = Handle<int, InstanceTag, uint32_t, 100, PoolIdPolicy<MagazineDeferredPolicy>>;
+	HDL::Pool<MagazineHandle> poolA;
+	HDL::Pool<MagazineHandle> poolB;
+	{
+		HDL::Pool<MagazineHandle>::ReadGuard guard(poolA);
+		auto handleA = poolA.Create(1);
+		auto handleB = poolB.Create(2);
+		REQUIRE(poolB.Destroy(handleB));
+		REQUIRE(poolA.Destroy(handleA));
+		REQUIRE(poolB.Collect() == 1);
+		REQUIRE(poolA.Collect() == 0);
+		REQUIRE(poolA.Size() == 1);
+	}
+	REQUIRE(poolA.Collect() == 1);
+	REQUIRE(poolA.Size() == 0);
+	REQUIRE(poolB.Size() == 0);
+}
+
+template <typename IntHandle>
+void TestRuntimeMaxSize()
+{
+	// The handle format allows 1M elements, but this pool only reserves memory for 1000.
+	IntHandle::Reset(1000);
+	REQUIRE(IntHandle::MaxSize() == 1000);
+	REQUIRE(!IntHandle::Reserve(1001));
+
+	std::vector<IntHandle> v(1200);
+	REQUIRE(IntHandle::CreateN(v.data(), v.size(), 1) == 1000);
+	REQUIRE(IntHandle::Create(1) == IntHandle::kInvalid);
+	REQUIRE(IntHandle::Capacity() == 1000);
+
+	// The limit still applies when the nodes are reused.
+	for (size_t i = 0; i < 1000; i += 2)
+		IntHandle::Destroy(v[i]);
+	REQUIRE(IntHandle::CreateN(v.data(), 600, 2) == 500);
+	REQUIRE(IntHandle::Create(1) == IntHandle::kInvalid);
+
+	IntHandle::Reset();
+	REQUIRE(IntHandle::MaxSize() == 1024 * 1024);
+}
+
+TEST_CASE("runtime max size", "[basics]")
+{
+	struct RuntimeMaxTag;
+	TestRuntimeMaxSize<Handle<int, RuntimeMaxTag, uint32_t, 1024 * 1024>>();
+	TestRuntimeMaxSize<Handle<int, RuntimeMaxTag, uint32_t, 1024 * 1024, SeparateVersionsPolicy>>();
+	TestRuntimeMaxSize<Handle<int, RuntimeMaxTag, uint32_t, 1024 * 1024, OccupancyBitmapPolicy>>();
+	TestRuntimeMaxSize<Handle<int, RuntimeMaxTag, uint32_t, 1024 * 1024, DensePolicy>>();
+	TestRuntimeMaxSize<Handle<int, RuntimeMaxTag, uint32_t, 1024 * 1024, ChunkedPolicy>>();
+	TestRuntimeMaxSize<Handle<int, RuntimeMaxTag, uint32_t, 1024 * 1024, HugePagesPolicy>>();
+
+	HDL::Pool<Handle<int, RuntimeMaxTag, uint32_t, 1024 * 1024, PoolIdPolicy<HDL::DefaultPolicy>>> pool(10);
+	REQUIRE(pool.MaxSize() == 10);
+}
+
+struct FullestPagePolicy : HDL::DefaultPolicy 
+{ 
+	static const HDL::FreeListMode kFreeListMode = HDL::FreeListMode::LockedFullestPage; 
+	static const bool kSeparateVersions = true; // For ShrinkToFit.
+};
+
+TEST_CASE("fullest page free list", "[basics]")
+{
+	using IntHandle = Handle<int, void, uint32_t, 64 * 1024, FullestPagePolicy>;
+	using pool_type = IntHandle::pool_type;
+
+	IntHandle::Reset();
+
+	// Fill 4 pages of 4 bytes nodes (the versions are separate).
+	const size_t nodesPerPage = HDL::VirtualMemory::GetPageSize() / 4;
+	std::vector<IntHandle> v(4 * nodesPerPage);
+	REQUIRE(IntHandle::CreateN(v.data(), v.size()) == v.size());
+
+	// Page 0 only keeps one element, page 1 loses one, page 2 loses two and page 3 is emptied.
+	for (size_t i = 1; i < nodesPerPage; ++i)
+		IntHandle::Destroy(v[i]);
+	IntHandle::Destroy(v[nodesPerPage + 10]);
+	IntHandle::Destroy(v[2 * nodesPerPage + 20]);
+	IntHandle::Destroy(v[2 * nodesPerPage + 30]);
+	for (size_t i = 3 * nodesPerPage; i < 4 * nodesPerPage; ++i)
+		IntHandle::Destroy(v[i]);
+
+	// The holes of the fullest pages are filled first.
+	REQUIRE(pool_type::GetIndex(IntHandle::Create()) == nodesPerPage + 10);
+	REQUIRE(pool_type::GetIndex(IntHandle::Create()) / nodesPerPage == 2);
+	REQUIRE(pool_type::GetIndex(IntHandle::Create()) / nodesPerPage == 2);
+	REQUIRE(pool_type::GetIndex(IntHandle::Create()) / nodesPerPage == 0);
+
+	// The empty page at the end was not touched, it can be released.
+	REQUIRE(IntHandle::ShrinkToFit() > 0);
+	REQUIRE(IntHandle::Capacity() == 3 * nodesPerPage);
+
+	// Then the unused nodes at the end are used, once the other pages are full.
+	std::vector<IntHandle> v2(nodesPerPage - 2);
+	REQUIRE(IntHandle::CreateN(v2.data(), v2.size()) == v2.size());
+	REQUIRE(IntHandle::Capacity() == 3 * nodesPerPage);
+	REQUIRE(pool_type::GetIndex(IntHandle::Create()) == 3 * nodesPerPage);
+	REQUIRE(!IntHandle::IsValid(v[3 * nodesPerPage]));
+}
+
+TEST_CASE("fullest page free list with nodes straddling pages", "[basics]")
+{
+	// 12 bytes nodes (the versions are separate), some of them start at the end of a page and end in the next one.
+	struct Vec3 { int x, y, z; };
+	using Vec3Handle = Handle<Vec3, void, uint32_t, 64 * 1024, FullestPagePolicy>;
+	using pool_type = Vec3Handle::pool_type;
+
+	Vec3Handle::Reset();
+
+	// A node belongs to the page that contains its beginning.
+	const size_t pageSize = HDL::VirtualMemory::GetPageSize();
+	auto pageOf = [&](size_t _index) { return _index * sizeof(Vec3) / pageSize; };
+
+	std::vector<Vec3Handle> v(4 * pageSize / sizeof(Vec3));
+	REQUIRE(Vec3Handle::CreateN(v.data(), v.size()) == v.size());
+
+	// One hole in the last node of page 1, two in page 2, and page 3 is emptied.
+	size_t lastOfPage1 = (2 * pageSize - 1) / sizeof(Vec3);
+	size_t firstOfPage2 = lastOfPage1 + 1;
+	REQUIRE(pageOf(lastOfPage1) == 1);
+	REQUIRE(pageOf(firstOfPage2) == 2);
+	Vec3Handle::Destroy(v[lastOfPage1]);
+	Vec3Handle::Destroy(v[firstOfPage2 + 10]);
+	Vec3Handle::Destroy(v[firstOfPage2 + 20]);
+	size_t page3Count = 0;
+	for (size_t i = 0; i < v.size(); ++i)
+	{
+		if (pageOf(i) == 3)
+		{
+			Vec3Handle::Destroy(v[i]);
+			page3Count++;
+		}
+	}
+
+	// The holes of the fullest pages are filled first.
+	REQUIRE(pool_type::GetIndex(Vec3Handle::Create()) == lastOfPage1);
+	REQUIRE(pageOf(pool_type::GetIndex(Vec3Handle::Create())) == 2);
+	REQUIRE(pageOf(pool_type::GetIndex(Vec3Handle::Create())) == 2);
+	for (size_t i = 0; i < page3Count; ++i)
+		REQUIRE(pageOf(pool_type::GetIndex(Vec3Handle::Create())) == 3);
+	REQUIRE(Vec3Handle::Size() == v.size());
+}
+
+struct LifoPolicy : HDL::DefaultPolicy { static const HDL::FreeListMode kFreeListMode = HDL::FreeListMode::LockedLifo; };
+struct LifoTag;
+
+TEST_CASE("reuse order", "[basics]")
+{
+	using FifoHandle = Handle<int, LifoTag, uint32_t, 16>;
+	using LifoHandle = Handle<int, LifoTag, uint16_t, 16, LifoPolicy>;
+
+	FifoHandle::Reset();
+	LifoHandle::Reset();
+
+	std::vector<FifoHandle> fifo(FifoHandle::MaxSize());
+	REQUIRE(FifoHandle::CreateN(fifo.data(), fifo.size()) == fifo.size());
+	std::vector<LifoHandle> lifo(8);
+	REQUIRE(LifoHandle::CreateN(lifo.data(), lifo.size()) == lifo.size());
+
+	FifoHandle::Destroy(fifo[3]);
+	FifoHandle::Destroy(fifo[7]);
+	LifoHandle::Destroy(lifo[3]);
+	LifoHandle::Destroy(lifo[7]);
+
+	// FIFO: the oldest free node is reused first.
+	REQUIRE(FifoHandle::pool_type::GetIndex(FifoHandle::Create()) == 3);
+	REQUIRE(FifoHandle::pool_type::GetIndex(FifoHandle::Create()) == 7);
+
+	// LIFO: the most recently freed node is reused first, even before the unused nodes at the end.
+	REQUIRE(LifoHandle::pool_type::GetIndex(LifoHandle::Create()) == 7);
+	REQUIRE(LifoHandle::pool_type::GetIndex(LifoHandle::Create()) == 3);
+	REQUIRE(LifoHandle::pool_type::GetIndex(LifoHandle::Create()) == 8);
+
+	// With LIFO, churn reuses the same node, its version wraps around after 2^kVersionNumBits cycles.
+	LifoHandle h = LifoHandle::Create();
+	const size_t numVersions = (size_t)1 << LifoHandle::pool_type::kVersionNumBits;
+	for (size_t i = 0; i < numVersions - 1; ++i)
+	{
+		LifoHandle::Destroy(LifoHandle::Create());
+		REQUIRE(LifoHandle::IsValid(h));
+	}
+	LifoHandle::Destroy(h);
+	for (size_t i = 0; i < numVersions - 1; ++i)
+	{
+		LifoHandle n = LifoHandle::Create();
+		REQUIRE(LifoHandle::pool_type::GetIndex(n) == LifoHandle::pool_type::GetIndex(h));
+		REQUIRE(!LifoHandle::IsValid(h));
+		LifoHandle::Destroy(n);
+	}
+	REQUIRE(LifoHandle::Create() == h);
+}
+
+struct RetirePolicy : HDL::DefaultPolicy 
+{ 
+	static const HDL::FreeListMode kFreeListMode = HDL::FreeListMode::LockedLifo; 
+	static const bool kRetireSaturatedNodes = true; 
+};
+
+struct FifoRetirePolicy : HDL::DefaultPolicy { static const bool kRetireSaturatedNodes = true; };
+struct RetireTag;
+
+TEST_CASE("retire saturated nodes", "[basics]")
+{
+	// 4 bits of index, 4 bits of version: each node can be used 15 times (14 for the last one).
+	using CharHandle = Handle<char, void, uint8_t, 16, RetirePolicy>;
+	using pool_type = CharHandle::pool_type;
+
+	CharHandle::Reset();
+
+	// With LIFO reuse, the first node is used until it's retired.
+	std::vector<CharHandle> stale;
+	for (int i = 0; i < 15; ++i)
+	{
+		stale.push_back(CharHandle::Create('a'));
+		REQUIRE(pool_type::GetIndex(stale.back()) == 0);
+		REQUIRE(CharHandle::Destroy(stale.back()));
+	}
+	REQUIRE(CharHandle::RetiredCount() == 1);
+	REQUIRE(CharHandle::Size() == 0);
+
+	auto h = CharHandle::Create('b');
+	REQUIRE(pool_type::GetIndex(h) == 1);
+	REQUIRE(CharHandle::Destroy(h));
+
+	// The stale handles of the retired node never become valid again.
+	for (auto staleHandle : stale)
+	{
+		REQUIRE(!CharHandle::IsValid(staleHandle));
+		REQUIRE(!CharHandle::Destroy(staleHandle));
+	}
+
+	// Use all the nodes until they are retired, then Create fails.
+	size_t numCreated = 15 + 1;
+	for (;;)
+	{
+		auto n = CharHandle::Create('c');
+		if (n == CharHandle::kInvalid)
+			break;
+		REQUIRE(CharHandle::Destroy(n));
+		numCreated++;
+	}
+	REQUIRE(numCreated == 15 * 15 + 14);
+	REQUIRE(CharHandle::RetiredCount() == CharHandle::MaxSize());
+	REQUIRE(CharHandle::Size() == 0);
+	for (auto staleHandle : stale)
+		REQUIRE(!CharHandle::IsValid(staleHandle));
+
+	// Same with the default FIFO free list and batches.
+	using FifoHandle = Handle<char, RetireTag, uint8_t, 16, FifoRetirePolicy>;
+
+	FifoHandle::Reset();
+	size_t numFifoCreated = 0;
+	for (;;)
+	{
+		FifoHandle batch[5];
+		size_t num = FifoHandle::CreateN(batch, 5, 'd');
+		numFifoCreated += num;
+		REQUIRE(FifoHandle::DestroyN(batch, num) == num);
+		if (num < 5)
+			break;
+	}
+	REQUIRE(numFifoCreated == 15 * 15 + 14);
+	REQUIRE(FifoHandle::RetiredCount() == FifoHandle::MaxSize());
+}
+
+// ShrinkToFit needs the versions in their own array.
+template <typename Policy>
+struct ShrinkablePolicy : Policy { static const bool kSeparateVersions = true; };
+
+template <typename IntHandle>
+void TestShrinkToFit()
+{
+	IntHandle::Reset();
+
+	std::vector<IntHandle> v(100 * 1000);
+	REQUIRE(IntHandle::CreateN(v.data(), v.size(), 1) == v.size());
+	size_t fullCapacity = IntHandle::Capacity();
+
+	// A live element keeps the nodes before it.
+	for (size_t i = 1000; i < v.size(); ++i)
+	{
+		if (i != 50 * 1000)
+			IntHandle::Destroy(v[i]);
+	}
+
+	REQUIRE(IntHandle::ShrinkToFit() > 0);
+	REQUIRE(IntHandle::Capacity() < fullCapacity);
+	REQUIRE(IntHandle::Capacity() > 50 * 1000);
+	REQUIRE(IntHandle::ShrinkToFit() == 0);
+
+	IntHandle::Destroy(v[50 * 1000]);
+	REQUIRE(IntHandle::ShrinkToFit() > 0);
+	REQUIRE(IntHandle::Capacity() < 50 * 1000);
+	REQUIRE(IntHandle::Size() == 1000);
+
+	// The stale handles of the released nodes stay invalid, also once their nodes are committed and used again.
+	size_t numStaleValid = 0;
+	for (size_t i = 1000; i < v.size(); ++i)
+		numStaleValid += IntHandle::IsValid(v[i]) || IntHandle::Get(v[i]) != nullptr || IntHandle::Destroy(v[i]);
+	REQUIRE(numStaleValid == 0);
+
+	std::vector<IntHandle> v2(v.size() - 1000);
+	REQUIRE(IntHandle::CreateN(v2.data(), v2.size(), 2) == v2.size());
+
+	for (size_t i = 1000; i < v.size(); ++i)
+		numStaleValid += IntHandle::IsValid(v[i]);
+	REQUIRE(numStaleValid == 0);
+
+	size_t numBadValues = 0;
+	for (size_t i = 0; i < 1000; ++i)
+		numBadValues += *IntHandle::Get(v[i]) != 1;
+	for (auto h : v2)
+		numBadValues += *IntHandle::Get(h) != 2;
+	REQUIRE(numBadValues == 0);
+}
+
+TEST_CASE("shrink to fit", "[basics]")
+{
+	struct ShrinkTag;
+	TestShrinkToFit<Handle<int, ShrinkTag, uint32_t, 128 * 1024, SeparateVersionsPolicy>>();
+	TestShrinkToFit<Handle<int, ShrinkTag, uint32_t, 128 * 1024, ShrinkablePolicy<OccupancyBitmapPolicy>>>();
+	TestShrinkToFit<Handle<int, ShrinkTag, uint32_t, 128 * 1024, ShrinkablePolicy<ChunkedPolicy>>>();
+	TestShrinkToFit<Handle<int, ShrinkTag, uint32_t, 128 * 1024, ShrinkablePolicy<DeferredPolicy>>>();
+	TestShrinkToFit<Handle<int, ShrinkTag, uint32_t, 128 * 1024, FullestPagePolicy>>();
+	TestShrinkToFit<Handle<int, ShrinkTag, uint32_t, 128 * 1024, ShrinkablePolicy<LifoPolicy>>>();
+
+	SECTION("dense storage")
+	{
+		using IntHandle = Handle<int, ShrinkTag, uint32_t, 128 * 1024, DensePolicy>;
+		IntHandle::Reset();
+
+		std::vector<IntHandle> v(100 * 1000);
+		REQUIRE(IntHandle::CreateN(v.data(), v.size(), 1) == v.size());
+		REQUIRE(IntHandle::DestroyN(v.data() + 1000, v.size() - 1000) == v.size() - 1000);
+
+		// Only the packed elements shrink, the versions are kept.
+		REQUIRE(IntHandle::ShrinkToFit() > 0);
+		REQUIRE(IntHandle::Capacity() < 2000);
+		REQUIRE(!IntHandle::IsValid(v[1000]));
+
+		REQUIRE(IntHandle::CreateN(v.data() + 1000, v.size() - 1000, 2) == v.size() - 1000);
+		REQUIRE(*IntHandle::Get(v[0]) == 1);
+		REQUIRE(*IntHandle::Get(v.back()) == 2);
+	}
+}
@@ -0,0 +1,369 @@
+#include "catch/catch.hpp"
+#include "handle.h"
+#include "handle_thread_pool.h"
+#include <thread>
+#include <vector>
+#include <string>
+
+// Benchmarks are hidden by default, run them with: HandleTest [benchmark]
+
+namespace
+{
+	struct Entity
+	{
+		float m_position[3];
+		float m_velocity[3];
+		int   m_flags;
+	};
+
+	const size_t kNumEntities = 500 * 1000;
+
+	struct PagePolicy      : HDL::DefaultPolicy { typedef HDL::GrowByPages<1> Growth; };
+	struct ChunkPolicy     : HDL::DefaultPolicy { typedef HDL::GrowByBytes<2 * 1024 * 1024> Growth; };
+	struct GeometricPolicy : HDL::DefaultPolicy { typedef HDL::GrowGeometric<2, 1> Growth; };
+
+	template <typename EntityHandle>
+	void CreateAll()
+	{
+		EntityHandle::Reset();
+
+		for (size_t i = 0; i < kNumEntities; ++i)
+			EntityHandle::Create();
+	}
+}
+
+TEST_CASE("growth policies benchmark", "[.][benchmark]")
+{
+	BENCHMARK("Create 500k - grow by 1 page")
+		CreateAll<Handle<Entity, void, uint32_t, 1024 * 1024, PagePolicy>>();
+
+	BENCHMARK("Create 500k - grow by 2 MiB")
+		CreateAll<Handle<Entity, void, uint32_t, 1024 * 1024, ChunkPolicy>>();
+
+	BENCHMARK("Create 500k - grow x2")
+		CreateAll<Handle<Entity, void, uint32_t, 1024 * 1024, GeometricPolicy>>();
+}
+
+namespace
+{
+	struct LockFreePolicy : HDL::DefaultPolicy { static const HDL::FreeListMode kFreeListMode = HDL::FreeListMode::LockFreeStack; };
+	struct MagazinePolicy : HDL::DefaultPolicy { static const size_t kMagazineSize = 64; };
+
+	// Each thread keeps a small working set of handles and keeps replacing them, as fast as possible.
+	template <typename EntityHandle>
+	void CreateDestroyChurn(int _numThreads, int _numOpsPerThread)
+	{
+		auto threadFunc = [_numOpsPerThread]()
+		{
+			EntityHandle handles[64];
+			for (auto& h : handles)
+				h = EntityHandle::Create();
+
+			for (int i = 0; i < _numOpsPerThread; ++i)
+			{
+				auto& h = handles[i % 64];
+				EntityHandle::Destroy(h);
+				h = EntityHandle::Create();
+			}
+
+			for (auto& h : handles)
+				EntityHandle::Destroy(h);
+		};
+
+		std::vector<std::thread> threads;
+		for (int i = 0; i < _numThreads; ++i)
+			threads.push_back(std::thread(threadFunc));
+
+		for (auto& th : threads)
+			th.join();
+	}
+
+	template <typename EntityHandle>
+	void BenchmarkChurnScaling(const char* _name)
+	{
+		EntityHandle::Reset();
+
+		int maxThreads = (int)std::thread::hardware_concurrency();
+		if (maxThreads < 1)
+			maxThreads = 1;
+
+		for (int numThreads = 1; ; numThreads *= 2)
+		{
+			if (numThreads > maxThreads)
+				numThreads = maxThreads;
+
+			// Same total amount of work (1M create/destroy) for every thread count.
+			std::string name = std::string(_name) + " - " + std::to_string(numThreads) + " threads";
+			BENCHMARK(name)
+				CreateDestroyChurn<EntityHandle>(numThreads, 1000 * 1000 / numThreads);
+
+			if (numThreads == maxThreads)
+				break;
+		}
+	}
+}
+
+TEST_CASE("free list scaling benchmark", "[.][benchmark]")
+{
+	BenchmarkChurnScaling<Handle<Entity, void, uint32_t, 64 * 1024>>("locked FIFO");
+	BenchmarkChurnScaling<Handle<Entity, void, uint32_t, 64 * 1024, LockFreePolicy>>("lock-free stack");
+	BenchmarkChurnScaling<Handle<Entity, void, uint32_t, 64 * 1024, MagazinePolicy>>("magazines");
+}
+
+TEST_CASE("batch functions benchmark", "[.][benchmark]")
+{
+	struct BatchTag;
+	using EntityHandle = Handle<Entity, BatchTag, uint32_t, 1024 * 1024>;
+
+	std::vector<EntityHandle> handles(kNumEntities);
+	std::vector<Entity*> entities(kNumEntities);
+
+	// Reserve first, to measure the lock and free list costs rather than the growth.
+	EntityHandle::Reset();
+	EntityHandle::Reserve(kNumEntities);
+
+	BENCHMARK("Create/Get/Destroy 500k - one by one")
+	{
+		for (size_t i = 0; i < kNumEntities; ++i)
+			handles[i] = EntityHandle::Create();
+		for (size_t i = 0; i < kNumEntities; ++i)
+			entities[i] = EntityHandle::Get(handles[i]);
+		for (size_t i = 0; i < kNumEntities; ++i)
+			EntityHandle::Destroy(handles[i]);
+	}
+
+	BENCHMARK("Create/Get/Destroy 500k - batched")
+	{
+		EntityHandle::CreateN(handles.data(), kNumEntities);
+		EntityHandle::GetN(handles.data(), entities.data(), kNumEntities);
+		EntityHandle::DestroyN(handles.data(), kNumEntities);
+	}
+
+	REQUIRE(EntityHandle::Size() == 0);
+}
+
+namespace
+{
+	struct SeparateVersionsPolicy : HDL::DefaultPolicy { static const bool kSeparateVersions = true; };
+
+	struct BigEntity
+	{
+		float m_transform[16];
+		float m_bounds[6];
+		int   m_flags;
+	};
+
+	template <typename EntityHandle>
+	void ValidateAll(const std::vector<EntityHandle>& _handles, size_t& _outNumValid)
+	{
+		for (auto h : _handles)
+			_outNumValid += EntityHandle::IsValid(h);
+	}
+}
+
+TEST_CASE("separate versions benchmark", "[.][benchmark]")
+{
+	struct InterleavedTag;
+	struct SeparateTag;
+	using InterleavedHandle = Handle<BigEntity, InterleavedTag, uint32_t, 1024 * 1024>;
+	using SeparateHandle    = Handle<BigEntity, SeparateTag,    uint32_t, 1024 * 1024, SeparateVersionsPolicy>;
+
+	std::vector<InterleavedHandle> interleavedHandles(kNumEntities);
+	std::vector<SeparateHandle>    separateHandles(kNumEntities);
+	InterleavedHandle::Reset();
+	SeparateHandle::Reset();
+	InterleavedHandle::CreateN(interleavedHandles.data(), kNumEntities);
+	SeparateHandle::CreateN(separateHandles.data(), kNumEntities);
+
+	size_t numValid = 0;
+
+	BENCHMARK("IsValid 500k - versions in nodes")
+		ValidateAll(interleavedHandles, numValid);
+
+	BENCHMARK("IsValid 500k - separate versions")
+		ValidateAll(separateHandles, numValid);
+
+	REQUIRE(numValid > 0);
+}
+
+namespace
+{
+	struct DensePolicy : HDL::DefaultPolicy { static const bool kDenseStorage = true; };
+}
+
+TEST_CASE("dense storage benchmark", "[.][benchmark]")
+{
+	struct SparseTag;
+	struct DenseTag;
+	using SparseHandle = Handle<Entity, SparseTag, uint32_t, 1024 * 1024>;
+	using DenseHandle  = Handle<Entity, DenseTag,  uint32_t, 1024 * 1024, DensePolicy>;
+
+	// Create everything then destroy half of the elements at random, to leave holes in the sparse pool.
+	std::vector<SparseHandle> sparseHandles(kNumEntities);
+	std::vector<DenseHandle>  denseHandles(kNumEntities);
+	SparseHandle::Reset();
+	DenseHandle::Reset();
+	SparseHandle::CreateN(sparseHandles.data(), kNumEntities);
+	DenseHandle::CreateN(denseHandles.data(), kNumEntities);
+
+	uint32_t random = 12345;
+	std::vector<SparseHandle> liveSparseHandles;
+	for (size_t i = 0; i < kNumEntities; ++i)
+	{
+		random = random * 1664525 + 1013904223;
+		if (random & 0x10000)
+		{
+			SparseHandle::Destroy(sparseHandles[i]);
+			DenseHandle::Destroy(denseHandles[i]);
+		}
+		else
+		{
+			liveSparseHandles.push_back(sparseHandles[i]);
+		}
+	}
+
+	float sum = 0.0f;
+
+	BENCHMARK("Update 250k - sparse, through handles")
+	{
+		for (auto h : liveSparseHandles)
+		{
+			Entity* entity = SparseHandle::Get(h);
+			for (int i = 0; i < 3; ++i)
+				entity->m_position[i] += entity->m_velocity[i];
+			sum += entity->m_position[0];
+		}
+	}
+
+	BENCHMARK("Update 250k - dense, linear scan")
+	{
+		Entity* entities = DenseHandle::Data();
+		for (size_t e = 0, count = DenseHandle::Size(); e < count; ++e)
+		{
+			for (int i = 0; i < 3; ++i)
+				entities[e].m_position[i] += entities[e].m_velocity[i];
+			sum += entities[e].m_position[0];
+		}
+	}
+
+	REQUIRE(DenseHandle::Size() == liveSparseHandles.size());
+	REQUIRE(sum == 0.0f);
+}
+
+namespace
+{
+	struct OccupancyBitmapPolicy : HDL::DefaultPolicy { static const bool kOccupancyBitmap = true; };
+
+	// Fills the pool then only keeps 1% of the elements alive.
+	template <typename EntityHandle>
+	void CreateSparsePool()
+	{
+		std::vector<EntityHandle> handles(kNumEntities);
+		EntityHandle::Reset();
+		EntityHandle::CreateN(handles.data(), kNumEntities);
+		for (size_t i = 0; i < kNumEntities; ++i)
+		{
+			if (i % 100 != 0)
+				EntityHandle::Destroy(handles[i]);
+		}
+	}
+}
+
+TEST_CASE("for each benchmark", "[.][benchmark]")
+{
+	struct ScanTag;
+	struct BitmapTag;
+	using ScanHandle   = Handle<Entity, ScanTag,   uint32_t, 1024 * 1024>;
+	using BitmapHandle = Handle<Entity, BitmapTag, uint32_t, 1024 * 1024, OccupancyBitmapPolicy>;
+
+	CreateSparsePool<ScanHandle>();
+	CreateSparsePool<BitmapHandle>();
+
+	int flags = 0;
+
+	BENCHMARK("ForEach 1% of 500k - version scan")
+		ScanHandle::ForEach([&flags](Entity& _entity) { flags += _entity.m_flags + 1; });
+
+	BENCHMARK("ForEach 1% of 500k - occupancy bitmap")
+		BitmapHandle::ForEach([&flags](Entity& _entity) { flags += _entity.m_flags + 1; });
+
+	REQUIRE(flags > 0);
+}
+
+TEST_CASE("parallel for each benchmark", "[.][benchmark]")
+{
+	struct ParallelTag;
+	using EntityHandle = Handle<Entity, ParallelTag, uint32_t, 1024 * 1024>;
+
+	std::vector<EntityHandle> handles(kNumEntities);
+	EntityHandle::Reset();
+	EntityHandle::CreateN(handles.data(), kNumEntities);
+
+	auto update = [](Entity& _entity)
+	{
+		for (int i = 0; i < 3; ++i)
+			_entity.m_position[i] += _entity.m_velocity[i];
+	};
+
+	HDL::ThreadPool threadPool;
+
+	BENCHMARK("Update 500k - ForEach")
+		EntityHandle::ForEach(update);
+
+	BENCHMARK("Update 500k - ParallelForEach (" + std::to_string(threadPool.GetNumThreads() + 1) + " threads)")
+		EntityHandle::ParallelForEach(update, threadPool);
+}
+
+namespace
+{
+	struct HugePagesPolicy : HDL::DefaultPolicy { static const bool kHugePages = true; };
+
+	const size_t kNumRandomEntities = 4 * 1024 * 1024; // 128 MiB of nodes, much more than what the TLB covers with 4 KiB pages.
+
+	template <typename EntityHandle>
+	void GetAllRandomOrder(const std::vector<EntityHandle>& _handles, int& _outFlags)
+	{
+		for (auto h : _handles)
+			_outFlags += EntityHandle::Get(h)->m_flags + 1;
+	}
+}
+
+// Run with `perf stat -e dTLB-load-misses` (Linux) to see the TLB misses, transparent huge pages must be enabled 
+// in "madvise" or "always" mode (see /sys/kernel/mm/transparent_hugepage/enabled).
+TEST_CASE("huge pages benchmark", "[.][benchmark]")
+{
+	struct PagesTag;
+	struct HugePagesTag;
+	using PagesHandle     = Handle<Entity, PagesTag,     uint32_t, kNumRandomEntities>;
+	using HugePagesHandle = Handle<Entity, HugePagesTag, uint32_t, kNumRandomEntities, HugePagesPolicy>;
+
+	std::vector<PagesHandle>     pagesHandles(kNumRandomEntities);
+	std::vector<HugePagesHandle> hugePagesHandles(kNumRandomEntities);
+	PagesHandle::Reset();
+	HugePagesHandle::Reset();
+	PagesHandle::CreateN(pagesHandles.data(), kNumRandomEntities);
+	HugePagesHandle::CreateN(hugePagesHandles.data(), kNumRandomEntities);
+
+	// Shuffle the handles (the same way for both pools), so that nearly every Get touches a different page.
+	uint32_t random = 12345;
+	for (size_t i = kNumRandomEntities - 1; i > 0; --i)
+	{
+		random = random * 1664525 + 1013904223;
+		size_t j = random % (i + 1);
+		std::swap(pagesHandles[i], pagesHandles[j]);
+		std::swap(hugePagesHandles[i], hugePagesHandles[j]);
+	}
+
+	int flags = 0;
+
+	BENCHMARK("Get 4M random - 4 KiB pages")
+		GetAllRandomOrder(pagesHandles, flags);
+
+	BENCHMARK("Get 4M random - huge pages")
+		GetAllRandomOrder(hugePagesHandles, flags);
+
+	REQUIRE(flags > 0);
+
+	PagesHandle::Reset();
+	HugePagesHandle::Reset();
+}
@@ -2,6 +2,7 @@
 #include "handle.h"
 #include <vector>
 #include <set>
+#include <string.h>
 
 struct LargeObject
 {
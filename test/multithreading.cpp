@@ -1,14 +1,16 @@
 #include "catch/catch.hpp"
 #include "handle.h"
+#include "handle_thread_pool.h"
 #include <vector>
 #include <set>
 #include <thread>
 #include <random>
 #include <atomic>
 
-TEST_CASE("concurrent creation/destruction of handles", "[multithreading]")
+template <typename IntHandle>
+void TestConcurrentCreateDestroy()
 {
-	using IntHandle = Handle<int, void, uint32_t, 1000>;
+	IntHandle::Reset();
 
 	std::atomic<bool> error = false;
 
@@ -115,4 +117,683 @@ TEST_CASE("concurrent creation/destruction of handles", "[multithreading]")
 
 	REQUIRE_FALSE(error); // Another REQUIRE should already have broken, but just in case.
 	REQUIRE(IntHandle::Size() == 0);
-}
\ No newline at end of file
+}
+
+TEST_CASE("concurrent creation/destruction of handles", "[multithreading]")
+{
+	TestConcurrentCreateDestroy<Handle<int, void, uint32_t, 1000>>();
+}
+
+struct LockFreePolicy : HDL::DefaultPolicy { static const HDL::FreeListMode kFreeListMode = HDL::FreeListMode::LockFreeStack; };
+
+TEST_CASE("concurrent creation/destruction of handles with a lock-free free list", "[multithreading]")
+{
+	TestConcurrentCreateDestroy<Handle<int, void, uint32_t, 1000, LockFreePolicy>>();
+}
+
+struct SeparateVersionsPolicy : HDL::DefaultPolicy { static const bool kSeparateVersions = true; };
+
+TEST_CASE("concurrent creation/destruction of handles with separate versions", "[multithreading]")
+{
+	TestConcurrentCreateDestroy<Handle<int, void, uint32_t, 1000, SeparateVersionsPolicy>>();
+}
+
+struct OccupancyBitmapPolicy : HDL::DefaultPolicy { static const bool kOccupancyBitmap = true; };
+
+TEST_CASE("concurrent creation/destruction of handles with an occupancy bitmap", "[multithreading]")
+{
+	TestConcurrentCreateDestroy<Handle<int, void, uint32_t, 1000, OccupancyBitmapPolicy>>();
+}
+
+struct FullestPagePolicy : HDL::DefaultPolicy { static const HDL::FreeListMode kFreeListMode = HDL::FreeListMode::LockedFullestPage; };
+
+TEST_CASE("concurrent creation/destruction of handles with a fullest page free list", "[multithreading]")
+{
+	TestConcurrentCreateDestroy<Handle<int, void, uint32_t, 1000, FullestPagePolicy>>();
+}
+
+struct LifoPolicy : HDL::DefaultPolicy { static const HDL::FreeListMode kFreeListMode = HDL::FreeListMode::LockedLifo; };
+
+TEST_CASE("concurrent creation/destruction of handles with a LIFO free list", "[multithreading]")
+{
+	TestConcurrentCreateDestroy<Handle<int, void, uint32_t, 1000, LifoPolicy>>();
+}
+
+struct ChunkedLockFreePolicy : LockFreePolicy { static const bool kChunkedStorage = true; static const size_t kChunkSize = 256; };
+
+TEST_CASE("concurrent creation/destruction of handles with chunked storage", "[multithreading]")
+{
+	// Small chunks, so that the storage grows while other threads are reading it.
+	TestConcurrentCreateDestroy<Handle<int, void, uint32_t, 1000, ChunkedLockFreePolicy>>();
+}
+
+struct MagazinePolicy : HDL::DefaultPolicy { static const size_t kMagazineSize = 32; };
+struct DeferredPolicy : HDL::DefaultPolicy { static const bool kDeferredDestruction = true; };
+
+TEST_CASE("concurrent creation/destruction of handles with magazines", "[multithreading]")
+{
+	TestConcurrentCreateDestroy<Handle<int, void, uint32_t, 1000, MagazinePolicy>>();
+}
+
+struct ShardedPolicy : HDL::DefaultPolicy { static const size_t kShardCount = 4; };
+
+TEST_CASE("concurrent creation/destruction of handles with shards", "[multithreading]")
+{
+	TestConcurrentCreateDestroy<Handle<int, void, uint32_t, 1000, ShardedPolicy>>();
+}
+
+TEST_CASE("concurrent cross-shard destructions", "[multithreading]")
+{
+	using IntHandle = Handle<int, void, uint32_t, 1024, ShardedPolicy>;
+
+	IntHandle::Reset();
+
+	// Each thread destroys the elements created by the next one (mostly in another shard, through its inbox), and creates new ones.
+	const int kNumThreads = 8;
+	std::vector<std::vector<std::atomic<uint32_t>>> handles(kNumThreads);
+	for (auto& threadHandles : handles)
+	{
+		threadHandles = std::vector<std::atomic<uint32_t>>(64);
+		for (auto& h : threadHandles)
+			h = IntHandle::kInvalid;
+	}
+
+	std::atomic<bool> badValue = false;
+	std::vector<std::thread> threads;
+	for (int i = 0; i < kNumThreads; ++i)
+	{
+		threads.push_back(std::thread([&, i]()
+		{
+			auto& ownHandles = handles[i];
+			auto& otherHandles = handles[(i + 1) % kNumThreads];
+			for (int j = 0; j < 5000; ++j)
+			{
+				auto& h = ownHandles[j % ownHandles.size()];
+				auto newHandle = IntHandle::Create(i);
+				auto oldHandle = h.exchange(newHandle);
+				if (oldHandle != IntHandle::kInvalid)
+				{
+					auto value = IntHandle::Get(IntHandle(oldHandle));
+					if (value && *value != i)
+						badValue = true;
+				}
+
+				auto otherHandle = otherHandles[j % otherHandles.size()].exchange(IntHandle::kInvalid);
+				IntHandle::Destroy(IntHandle(otherHandle));
+				IntHandle::Destroy(IntHandle(oldHandle));
+			}
+		}));
+	}
+
+	for (auto& th : threads)
+		th.join();
+
+	REQUIRE_FALSE(badValue);
+
+	for (auto& threadHandles : handles)
+	{
+		for (auto& h : threadHandles)
+			IntHandle::Destroy(IntHandle(h.load()));
+	}
+
+	// The indices still in the inboxes are reused.
+	std::vector<IntHandle> all(IntHandle::MaxSize());
+	REQUIRE(IntHandle::CreateN(all.data(), all.size(), 0) == all.size());
+	REQUIRE(IntHandle::DestroyN(all.data(), all.size()) == all.size());
+}
+
+TEST_CASE("magazines are flushed when threads exit", "[multithreading]")
+{
+	using IntHandle = Handle<int, void, uint32_t, 64, MagazinePolicy>;
+
+	IntHandle::Reset();
+
+	// Use all the indices in another thread, and destroy them. Its magazine will be full when it exits.
+	std::thread thread([]()
+	{
+		std::vector<IntHandle> v;
+		for (int i = 0; i < (int)IntHandle::MaxSize(); ++i)
+			v.push_back(IntHandle::Create(i));
+
+		for (auto h : v)
+			IntHandle::Destroy(h);
+	});
+	thread.join();
+
+	REQUIRE(IntHandle::Size() == 0);
+
+	// All the indices should be available again.
+	std::vector<IntHandle> v;
+	for (int i = 0; i < (int)IntHandle::MaxSize(); ++i)
+	{
+		v.push_back(IntHandle::Create(i));
+		REQUIRE(v.back() != IntHandle::kInvalid);
+	}
+
+	WHEN("destroying handles")
+	{
+		for (auto h : v)
+			IntHandle::Destroy(h);
+
+		THEN("their indices are reused by this thread first")
+		{
+			auto h = IntHandle::Create(-1);
+			REQUIRE(IntHandle::pool_type::GetIndex(h) == IntHandle::pool_type::GetIndex(v.back()));
+		}
+
+		THEN("flushing the magazine makes them available to other threads")
+		{
+			IntHandle::FlushMagazine();
+
+			bool success = true;
+			std::thread([&]()
+			{
+				for (int i = 0; i < (int)IntHandle::MaxSize(); ++i)
+					success &= IntHandle::Create(i) != IntHandle::kInvalid;
+			}).join();
+
+			REQUIRE(success);
+		}
+	}
+}
+
+struct PoolIdMagazinePolicy : MagazinePolicy { static const size_t kPoolIdNumBits = 4; };
+
+TEST_CASE("each pool has its own magazines", "[multithreading]")
+{
+	using IntHandle = Handle<int, void, uint32_t, 64, PoolIdMagazinePolicy>;
+
+	IntHandle::Reset();
+	HDL::Pool<IntHandle> poolA;
+	HDL::Pool<IntHandle> poolB;
+
+	// Alternate between the pools in another thread: their magazines are filled independently, and all flushed when it exits.
+	std::thread thread([&]()
+	{
+		std::vector<IntHandle> v;
+		for (int i = 0; i < (int)IntHandle::MaxSize(); ++i)
+		{
+			v.push_back(poolA.Create(i));
+			v.push_back(poolB.Create(i));
+			v.push_back(IntHandle::Create(i));
+		}
+
+		for (size_t i = 0; i < v.size(); i += 3)
+		{
+			poolA.Destroy(v[i]);
+			poolB.Destroy(v[i + 1]);
+			IntHandle::Destroy(v[i + 2]);
+		}
+	});
+	thread.join();
+
+	REQUIRE(poolA.Size() == 0);
+	REQUIRE(poolB.Size() == 0);
+	REQUIRE(IntHandle::Size() == 0);
+
+	// All the indices should be available again, in every pool.
+	for (int i = 0; i < (int)IntHandle::MaxSize(); ++i)
+	{
+		REQUIRE(poolA.Create(i) != IntHandle::kInvalid);
+		REQUIRE(poolB.Create(i) != IntHandle::kInvalid);
+		REQUIRE(IntHandle::Create(i) != IntHandle::kInvalid);
+	}
+}
+
+TEST_CASE("concurrent shrink to fit", "[multithreading]")
+{
+	using IntHandle = Handle<int, void, uint32_t, 64 * 1024, SeparateVersionsPolicy>;
+	IntHandle::Reset();
+
+	// The threads create bursts of elements then destroy them all, while the main thread keeps releasing the free pages.
+	// The stale handles are checked again while their nodes are released.
+	std::atomic<int> numRunning { 4 };
+	std::atomic<int> numErrors  { 0 };
+	auto threadFunc = [&](int _id)
+	{
+		std::vector<IntHandle> handles;
+		for (int burst = 0; burst < 50; ++burst)
+		{
+			handles.resize(1000 + (burst * 997) % 8000);
+			IntHandle::CreateN(handles.data(), handles.size(), _id);
+
+			for (auto h : handles)
+			{
+				int* value = IntHandle::Get(h);
+				numErrors += value == nullptr || *value != _id;
+			}
+
+			numErrors += IntHandle::DestroyN(handles.data(), handles.size()) != handles.size();
+
+			for (auto h : handles)
+				numErrors += IntHandle::IsValid(h) || IntHandle::Get(h) != nullptr || IntHandle::Destroy(h);
+		}
+		numRunning--;
+	};
+
+	std::vector<std::thread> threads;
+	for (int i = 0; i < numRunning; ++i)
+		threads.push_back(std::thread(threadFunc, i));
+
+	while (numRunning > 0)
+		IntHandle::ShrinkToFit();
+
+	for (auto& th : threads)
+		th.join();
+
+	REQUIRE(numErrors == 0);
+	REQUIRE(IntHandle::Size() == 0);
+
+	IntHandle::ShrinkToFit();
+	REQUIRE(IntHandle::Capacity() == 0);
+}
+
+TEST_CASE("concurrent destruction of the same handles", "[multithreading]")
+{
+	using IntHandle = Handle<int, void, uint32_t, 1000>;
+
+	IntHandle::Reset();
+
+	std::vector<IntHandle> handles;
+	for (int i = 0; i < (int)IntHandle::MaxSize(); ++i)
+		handles.push_back(IntHandle::Create(i));
+
+	// Half the threads try to destroy all the handles, the other half read them.
+	std::atomic<int> destroyCount = 0;
+	std::atomic<bool> badValue = false;
+	std::vector<std::thread> threads;
+	for (int i = 0; i < 8; ++i)
+	{
+		threads.push_back(std::thread([&, i]()
+		{
+			for (int j = 0; j < (int)handles.size(); ++j)
+			{
+				if (i % 2 == 0)
+				{
+					if (IntHandle::Destroy(handles[j]))
+						destroyCount++;
+				}
+				else if (auto ptr = IntHandle::Get(handles[j]))
+				{
+					if (*ptr != j)
+						badValue = true;
+				}
+			}
+		}));
+	}
+
+	for (auto& th : threads)
+		th.join();
+
+	REQUIRE_FALSE(badValue);
+	REQUIRE(destroyCount == (int)handles.size()); // Each handle was destroyed exactly once.
+	REQUIRE(IntHandle::Size() == 0);
+}
+
+TEST_CASE("concurrent reads and deferred destructions", "[multithreading]")
+{
+	struct Object
+	{
+		int m_value;
+		Object(int _value) : m_value(_value) {}
+		~Object() { m_value = -1; }
+	};
+
+	using ObjectHandle = Handle<Object, void, uint32_t, 1024, DeferredPolicy>;
+
+	ObjectHandle::Reset();
+
+	std::vector<std::atomic<uint32_t>> handles(256);
+	for (auto& h : handles)
+		h = ObjectHandle::Create(1);
+
+	// Some threads keep replacing the objects, others read them inside read sections.
+	std::atomic<bool> badValue = false;
+	std::atomic<bool> stop = false;
+	std::vector<std::thread> threads;
+	for (int i = 0; i < 8; ++i)
+	{
+		threads.push_back(std::thread([&, i]()
+		{
+			std::mt19937 randomEngine(i);
+			for (int j = 0; j < 20000; ++j)
+			{
+				auto& h = handles[std::uniform_int_distribution<>(0, (int)handles.size() - 1)(randomEngine)];
+
+				if (i % 2 == 0)
+				{
+					auto newHandle = ObjectHandle::Create(1);
+					if (newHandle == ObjectHandle::kInvalid)
+						continue; // Too many destructions are waiting for the read sections to end.
+
+					auto oldHandle = h.exchange(newHandle);
+					ObjectHandle::Destroy(ObjectHandle(oldHandle));
+				}
+				else
+				{
+					ObjectHandle::ReadGuard guard;
+					if (auto ptr = ObjectHandle::Get(ObjectHandle(h.load())))
+					{
+						std::this_thread::yield(); // Give the other threads some time to destroy it.
+						if (ptr->m_value != 1)
+							badValue = true;
+					}
+				}
+			}
+		}));
+	}
+
+	for (auto& th : threads)
+		th.join();
+
+	REQUIRE_FALSE(badValue);
+
+	for (auto& h : handles)
+		REQUIRE(ObjectHandle::Destroy(ObjectHandle(h.load())));
+
+	ObjectHandle::Collect();
+	REQUIRE(ObjectHandle::Size() == 0);
+}
+
+struct RefCountingPolicy : HDL::DefaultPolicy { static const HDL::FreeListMode kFreeListMode = HDL::FreeListMode::LockFreeStack; static const bool kRefCounting = true; };
+
+TEST_CASE("concurrent pins and destructions", "[multithreading]")
+{
+	struct Object
+	{
+		int m_value;
+		Object(int _value) : m_value(_value) {}
+		~Object() { m_value = -1; }
+	};
+
+	using ObjectHandle = Handle<Object, void, uint32_t, 1024, RefCountingPolicy>;
+
+	ObjectHandle::Reset();
+
+	std::vector<std::atomic<uint32_t>> handles(256);
+	for (auto& h : handles)
+		h = ObjectHandle::Create(1);
+
+	// Some threads keep replacing the objects, others pin them (without any lock, the indices are reused immediately).
+	std::atomic<bool> badValue = false;
+	std::vector<std::thread> threads;
+	for (int i = 0; i < 8; ++i)
+	{
+		threads.push_back(std::thread([&, i]()
+		{
+			std::mt19937 randomEngine(i);
+			for (int j = 0; j < 20000; ++j)
+			{
+				auto& h = handles[std::uniform_int_distribution<>(0, (int)handles.size() - 1)(randomEngine)];
+
+				if (i % 2 == 0)
+				{
+					auto newHandle = ObjectHandle::Create(1);
+					if (newHandle == ObjectHandle::kInvalid)
+						continue; // Too many destructions are waiting for their pins to be released.
+
+					auto oldHandle = h.exchange(newHandle);
+					ObjectHandle::Destroy(ObjectHandle(oldHandle));
+				}
+				else if (ObjectHandle::Pinned pinned{ ObjectHandle(h.load()) })
+				{
+					std::this_thread::yield(); // Give the other threads some time to destroy it.
+					if (pinned->m_value != 1)
+						badValue = true;
+				}
+			}
+		}));
+	}
+
+	for (auto& th : threads)
+		th.join();
+
+	REQUIRE_FALSE(badValue);
+
+	for (auto& h : handles)
+		REQUIRE(ObjectHandle::Destroy(ObjectHandle(h.load())));
+
+	REQUIRE(ObjectHandle::Size() == 0);
+}
+
+struct ReplaceablePolicy : HDL::DefaultPolicy 
+{ 
+	static const HDL::FreeListMode kFreeListMode = HDL::FreeListMode::LockFreeStack; 
+	static const bool kDeferredDestruction = true; 
+	static const bool kReplaceable = true; 
+};
+
+TEST_CASE("concurrent replaces, reads and destructions", "[multithreading]")
+{
+	struct Object
+	{
+		int m_value;
+		Object(int _value) : m_value(_value) {}
+		~Object() { m_value = -1; }
+	};
+
+	using ObjectHandle = Handle<Object, void, uint32_t, 1024, ReplaceablePolicy>;
+
+	ObjectHandle::Reset();
+
+	std::vector<std::atomic<uint32_t>> handles(64);
+	for (auto& h : handles)
+		h = ObjectHandle::Create(1);
+
+	// Some threads replace the objects in place, some destroy and recreate them, others read them inside read sections.
+	std::atomic<bool> badValue = false;
+	std::atomic<int> numReplaced = 0;
+	std::vector<std::thread> threads;
+	for (int i = 0; i < 9; ++i)
+	{
+		threads.push_back(std::thread([&, i]()
+		{
+			std::mt19937 randomEngine(i);
+			for (int j = 0; j < 20000; ++j)
+			{
+				auto& h = handles[std::uniform_int_distribution<>(0, (int)handles.size() - 1)(randomEngine)];
+
+				if (i % 3 == 0)
+				{
+					numReplaced += ObjectHandle::Replace(ObjectHandle(h.load()), 1);
+				}
+				else if (i % 3 == 1)
+				{
+					auto newHandle = ObjectHandle::Create(1);
+					if (newHandle == ObjectHandle::kInvalid)
+						continue; // Too many destructions are waiting for the read sections to end.
+
+					auto oldHandle = h.exchange(newHandle);
+					ObjectHandle::Destroy(ObjectHandle(oldHandle));
+				}
+				else
+				{
+					ObjectHandle::ReadGuard guard;
+					if (auto ptr = ObjectHandle::Get(ObjectHandle(h.load())))
+					{
+						std::this_thread::yield(); // Give the other threads some time to replace or destroy it.
+						if (ptr->m_value != 1)
+							badValue = true;
+					}
+				}
+			}
+		}));
+	}
+
+	for (auto& th : threads)
+		th.join();
+
+	REQUIRE_FALSE(badValue);
+	REQUIRE(numReplaced > 0);
+
+	for (auto& h : handles)
+		REQUIRE(ObjectHandle::Destroy(ObjectHandle(h.load())));
+
+	ObjectHandle::Collect();
+	REQUIRE(ObjectHandle::Size() == 0);
+}
+
+struct NodeLocksPolicy : HDL::DefaultPolicy { static const bool kNodeLocks = true; };
+
+TEST_CASE("concurrent node locks and destructions", "[multithreading]")
+{
+	// Not atomic, the lock protects it.
+	struct Counter { int m_value; int m_copy; };
+
+	using CounterHandle = Handle<Counter, void, uint32_t, 1024, NodeLocksPolicy>;
+
+	CounterHandle::Reset();
+
+	std::vector<std::atomic<uint32_t>> handles(16);
+	for (auto& h : handles)
+		h = CounterHandle::Create(Counter{ 0, 0 });
+
+	// Some threads increment the counters under their lock, others destroy and recreate them.
+	std::atomic<bool> badValue = false;
+	std::vector<std::thread> threads;
+	for (int i = 0; i < 8; ++i)
+	{
+		threads.push_back(std::thread([&, i]()
+		{
+			std::mt19937 randomEngine(i);
+			for (int j = 0; j < 20000; ++j)
+			{
+				auto& h = handles[std::uniform_int_distribution<>(0, (int)handles.size() - 1)(randomEngine)];
+
+				if (i % 4 == 0)
+				{
+					auto oldHandle = h.exchange(CounterHandle::Create(Counter{ 0, 0 }));
+					CounterHandle::Destroy(CounterHandle(oldHandle));
+				}
+				else if (auto counter = CounterHandle::GetLocked(CounterHandle(h.load())))
+				{
+					if (counter->m_value != counter->m_copy)
+						badValue = true;
+					counter->m_value++;
+					counter->m_copy = counter->m_value;
+				}
+			}
+		}));
+	}
+
+	for (auto& th : threads)
+		th.join();
+
+	REQUIRE_FALSE(badValue);
+
+	for (auto& h : handles)
+		REQUIRE(CounterHandle::Destroy(CounterHandle(h.load())));
+	REQUIRE(CounterHandle::Size() == 0);
+}
+
+TEST_CASE("concurrent try reads and destructions", "[multithreading]")
+{
+	// Each object has all its fields equal, a torn read would mix two objects.
+	struct Object { uint64_t m_values[8]; };
+
+	using ObjectHandle = Handle<Object, void, uint32_t, 1024, LockFreePolicy>;
+
+	ObjectHandle::Reset();
+
+	auto makeObject = [](uint64_t _value) { Object o; for (auto& v : o.m_values) v = _value; return o; };
+
+	std::vector<std::atomic<uint32_t>> handles(64);
+	for (auto& h : handles)
+		h = ObjectHandle::Create(makeObject(0));
+
+	// Some threads keep replacing the objects (their nodes are reused immediately), others read them without any lock.
+	std::atomic<bool> tornRead = false;
+	std::atomic<int> numRead = 0;
+	std::vector<std::thread> threads;
+	for (int i = 0; i < 8; ++i)
+	{
+		threads.push_back(std::thread([&, i]()
+		{
+			std::mt19937 randomEngine(i);
+			for (int j = 0; j < 20000; ++j)
+			{
+				auto& h = handles[std::uniform_int_distribution<>(0, (int)handles.size() - 1)(randomEngine)];
+
+				if (i % 2 == 0)
+				{
+					auto oldHandle = h.exchange(ObjectHandle::Create(makeObject(i * 20000 + j)));
+					ObjectHandle::Destroy(ObjectHandle(oldHandle));
+				}
+				else
+				{
+					Object o;
+					if (ObjectHandle::TryRead(ObjectHandle(h.load()), o))
+					{
+						numRead++;
+						for (auto v : o.m_values)
+						{
+							if (v != o.m_values[0])
+								tornRead = true;
+						}
+					}
+				}
+			}
+		}));
+	}
+
+	for (auto& th : threads)
+		th.join();
+
+	REQUIRE_FALSE(tornRead);
+	REQUIRE(numRead > 0);
+}
+
+struct ParallelOccupancyBitmapPolicy : HDL::DefaultPolicy { static const bool kOccupancyBitmap = true; };
+struct ParallelDensePolicy           : HDL::DefaultPolicy { static const bool kDenseStorage = true; };
+
+template <typename IntHandle, typename Executor>
+void TestParallelForEach(Executor& _executor)
+{
+	IntHandle::Reset();
+
+	std::vector<IntHandle> v(100 * 1000);
+	IntHandle::CreateN(v.data(), v.size(), 0);
+
+	for (size_t i = 0; i < v.size(); i += 3)
+		IntHandle::Destroy(v[i]);
+
+	std::atomic<size_t> numVisited { 0 };
+	IntHandle::ParallelForEach([&numVisited](int& _value) { _value++; numVisited++; }, _executor);
+
+	// Every element must have been visited exactly once.
+	REQUIRE(numVisited == IntHandle::Size());
+
+	size_t numVisitedOnce = 0;
+	for (size_t i = 0; i < v.size(); ++i)
+	{
+		if (i % 3 != 0)
+			numVisitedOnce += *IntHandle::Get(v[i]) == 1;
+	}
+	REQUIRE(numVisitedOnce == IntHandle::Size());
+}
+
+TEST_CASE("parallel for each", "[multithreading]")
+{
+	struct ParallelTag;
+
+	GIVEN("the built-in thread pool")
+	{
+		HDL::ThreadPool threadPool(3);
+		TestParallelForEach<Handle<int, ParallelTag, uint32_t, 100 * 1000>>(threadPool);
+		TestParallelForEach<Handle<int, ParallelTag, uint32_t, 100 * 1000, ParallelOccupancyBitmapPolicy>>(threadPool);
+		TestParallelForEach<Handle<int, ParallelTag, uint32_t, 100 * 1000, ParallelDensePolicy>>(threadPool);
+	}
+
+	GIVEN("a custom executor")
+	{
+		// Runs the tasks in reverse order on the calling thread.
+		auto executor = [](size_t _numTasks, const HDL::ParallelTask& _task)
+		{
+			for (size_t i = _numTasks; i > 0; --i)
+				_task(i - 1);
+		};
+
+		TestParallelForEach<Handle<int, ParallelTag, uint32_t, 100 * 1000>>(executor);
+		TestParallelForEach<Handle<int, ParallelTag, uint32_t, 100 * 1000, ParallelOccupancyBitmapPolicy>>(executor);
+	}
+}
@@ -0,0 +1,89 @@
+#include "catch/catch.hpp"
+#include "handle.h"
+#include <string.h>
+
+static bool IsZero(const char* _buffer, size_t _size)
+{
+	for (size_t i = 0; i < _size; ++i)
+	{
+		if (_buffer[i] != 0)
+			return false;
+	}
+	return true;
+}
+
+TEST_CASE("virtual memory commit/decommit", "[virtualmemory]")
+{
+	using namespace HDL::VirtualMemory;
+
+	const size_t pageSize = GetPageSize();
+	const size_t numPages = 16;
+
+	REQUIRE(pageSize > 0);
+	REQUIRE((pageSize & (pageSize - 1)) == 0);
+
+	char* buffer = (char*)Reserve(numPages * pageSize);
+	REQUIRE(buffer != nullptr);
+
+	GIVEN("a few committed pages")
+	{
+		// Commit an unaligned range, all the pages it touches should be committed.
+		REQUIRE(Commit(buffer + 10, 2 * pageSize));
+
+		THEN("the committed memory is zeroed and writable")
+		{
+			REQUIRE(IsZero(buffer, 3 * pageSize));
+
+			memset(buffer, 0xAB, 3 * pageSize);
+			REQUIRE(buffer[3 * pageSize - 1] == (char)0xAB);
+		}
+
+		WHEN("decommitting and committing them again")
+		{
+			memset(buffer, 0xAB, 3 * pageSize);
+			Decommit(buffer + pageSize, 2 * pageSize);
+			REQUIRE(Commit(buffer + pageSize, 2 * pageSize));
+
+			THEN("the pages that were decommitted contain zeros again")
+			{
+				REQUIRE(buffer[0] == (char)0xAB);
+				REQUIRE(IsZero(buffer + pageSize, 2 * pageSize));
+			}
+
+			THEN("the address did not change")
+			{
+				buffer[pageSize] = 1;
+				REQUIRE(buffer[pageSize] == 1);
+			}
+		}
+	}
+
+	Release(buffer, numPages * pageSize);
+}
+
+TEST_CASE("virtual memory huge pages", "[virtualmemory]")
+{
+	using namespace HDL::VirtualMemory;
+
+	const size_t hugePageSize = GetPageSize(true);
+
+	REQUIRE(hugePageSize >= GetPageSize());
+	REQUIRE((hugePageSize & (hugePageSize - 1)) == 0);
+
+	// The reservation is aligned, so that each committed huge page can be backed by a real huge page.
+	char* buffer = (char*)Reserve(3 * hugePageSize + 10, true);
+	REQUIRE(buffer != nullptr);
+	REQUIRE((size_t)buffer % hugePageSize == 0);
+
+	REQUIRE(Commit(buffer, 2 * hugePageSize));
+	REQUIRE(IsZero(buffer, 2 * hugePageSize));
+
+	memset(buffer, 0xAB, 2 * hugePageSize);
+	REQUIRE(buffer[2 * hugePageSize - 1] == (char)0xAB);
+
+	// The rounded up size can be committed too.
+	REQUIRE(Commit(buffer + 2 * hugePageSize, 2 * hugePageSize));
+	buffer[4 * hugePageSize - 1] = 1;
+
+	Release(buffer, 3 * hugePageSize + 10, true);
+}